@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+"""
+Measures latency and throughput of nzxt-smart2 hwmon reads, using the uhid
+device simulator (simulate.py), so it runs without the device.
+
+Three phases:
+
+- cold start: the first read after the device appears, which waits for the
+  first status report. "wakeup" is the time from the report being sent to the
+  read returning.
+- warm reads: a single reader, for every attribute separately.
+- contention: 1, 2, 4, ... reader processes reading all attributes at the same
+  time, while the simulator sends status reports at --interval. Shows how
+  readers scale, and how they contend with each other and with the report
+  handler.
+"""
+
+import math
+import multiprocessing
+import os
+import sys
+import time
+from array import array
+
+from simulate import FAN_CHANNELS, Simulator, parse_fan_types
+
+
+ATTRIBUTES = ['fan1_input', 'pwm1', 'in0_input', 'curr1_input']
+
+
+def percentile(values, p):
+	"""values must be sorted"""
+	if not values:
+		return math.nan
+
+	return values[min(len(values) - 1, max(0, math.ceil(p / 100 * len(values)) - 1))]
+
+
+def format_latencies(latencies):
+	latencies = sorted(latencies)
+	return (f'p50 {percentile(latencies, 50) * 1e6:8.1f} us  '
+		f'p99 {percentile(latencies, 99) * 1e6:8.1f} us  '
+		f'max {latencies[-1] * 1e6:8.1f} us')
+
+
+def read_loop(hwmon, attributes, start, duration):
+	"""Reads attributes round-robin, returns latencies of all reads."""
+	fds = [os.open(os.path.join(hwmon, name), os.O_RDONLY) for name in attributes]
+	latencies = array('d')
+
+	delay = start - time.monotonic()
+	if delay > 0:
+		time.sleep(delay)
+
+	end = start + duration
+	i = 0
+	now = time.monotonic()
+
+	while now < end:
+		os.pread(fds[i], 64, 0)
+		finished = time.monotonic()
+		latencies.append(finished - now)
+		now = finished
+		i = (i + 1) % len(fds)
+
+	for fd in fds:
+		os.close(fd)
+
+	return latencies
+
+
+def bench_cold(args):
+	print(f'Cold start ({args.cold_runs} runs):')
+
+	latencies = []
+	wakeups = []
+
+	for run in range(args.cold_runs):
+		attribute = ATTRIBUTES[run % len(ATTRIBUTES)]
+		simulator = Simulator(args.fans, args.interval)
+		simulator.start()
+
+		try:
+			hwmon = simulator.hwmon(args.timeout)
+
+			start = time.monotonic()
+			with open(os.path.join(hwmon, attribute)) as f:
+				f.read()
+			finished = time.monotonic()
+
+			latencies.append(finished - start)
+			if simulator.first_report_time and simulator.first_report_time > start:
+				wakeups.append(finished - simulator.first_report_time)
+
+		finally:
+			simulator.stop()
+
+	print(f'  first read   {format_latencies(latencies)}')
+	if wakeups:
+		print(f'  wakeup       {format_latencies(wakeups)}')
+
+
+def bench_warm(hwmon, args):
+	print(f'Warm reads, single reader ({args.duration:.1f} s per attribute):')
+
+	for attribute in ATTRIBUTES:
+		latencies = read_loop(hwmon, [attribute], time.monotonic(), args.duration)
+		print(f'  {attribute:12} {format_latencies(latencies)}  '
+		      f'{len(latencies) / args.duration:9.0f} reads/s')
+
+
+def bench_contention(hwmon, simulator, args):
+	print(f'Contention, all attributes, reports every {simulator.interval * 1000:.1f} ms '
+	      f'({args.duration:.1f} s per step):')
+
+	context = multiprocessing.get_context('fork')
+	readers = 1
+
+	while readers <= args.readers:
+		start = time.monotonic() + 0.2
+		reports = simulator.status_reports
+
+		with context.Pool(readers) as pool:
+			results = pool.starmap(read_loop, [(hwmon, ATTRIBUTES, start, args.duration)] * readers)
+
+		latencies = [latency for result in results for latency in result]
+		reports = simulator.status_reports - reports
+
+		print(f'  {readers:3} readers  {format_latencies(latencies)}  '
+		      f'{len(latencies) / args.duration:9.0f} reads/s  {reports} reports')
+
+		readers *= 2
+
+
+def main():
+	import argparse
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--fans', type=parse_fan_types, default='pwm,dc,none',
+			    help='fan types (pwm, dc or none) of the 3 channels')
+	parser.add_argument('--interval', type=float, default=0.25,
+			    help='status report interval in seconds (default: 0.25, like '
+				 'the device at its fastest)')
+	parser.add_argument('--duration', type=float, default=2.0,
+			    help='duration of every measurement in seconds')
+	parser.add_argument('--cold-runs', type=int, default=20,
+			    help='number of cold start measurements')
+	parser.add_argument('--readers', type=int, default=os.cpu_count(),
+			    help='maximum number of concurrent readers')
+	parser.add_argument('--timeout', type=float, default=5.0,
+			    help='how long to wait for the driver (in seconds)')
+	args = parser.parse_args()
+
+	if args.cold_runs:
+		bench_cold(args)
+
+	simulator = Simulator(args.fans, args.interval)
+	simulator.start()
+
+	try:
+		hwmon = simulator.hwmon(args.timeout)
+
+		# Wait for the first sample
+		for channel in range(FAN_CHANNELS):
+			with open(os.path.join(hwmon, f'curr{channel + 1}_input')) as f:
+				f.read()
+
+		bench_warm(hwmon, args)
+		bench_contention(hwmon, simulator, args)
+
+	finally:
+		simulator.stop()
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,619 @@
+#!/usr/bin/env python3
+"""
+Replays interrupt IN reports from a usbmon pcapng capture into the
+nzxt-smart2 driver through /dev/uhid, then checks sysfs values.
+
+The capture must be made with usbmon (LINKTYPE_USB_LINUX_MMAPPED), like
+only-fan3-pwm-1000rpm-50percent-ro.pcapng. The report descriptor and
+vendor/product ids are taken from the capture.
+
+The fan config report (0x61) from the capture is sent in response to the
+driver's "detect fans" command, status reports (0x67) follow it.
+
+With --policy, a BPF fan policy that always returns the given duty cycle is
+attached to nzxt_smart2_fan_policy(), and connected channels are switched to
+policy mode (pwm*_enable = 4) before the replay. The driver must then send a
+"set fan speed" report (0x62) with that duty cycle for all of them.
+"""
+
+import ctypes
+import os
+import platform
+import select
+import struct
+import sys
+import time
+
+
+LINKTYPE_USB_LINUX_MMAPPED = 220
+
+USBMON_HEADER = struct.Struct('<QcBBBHccqiiII8siiII')
+
+XFER_TYPE_INTERRUPT = 1
+XFER_TYPE_CONTROL = 2
+
+USB_DT_DEVICE = 0x01
+HID_DT_REPORT = 0x22
+
+INPUT_REPORT_ID_FAN_CONFIG = 0x61
+INPUT_REPORT_ID_FAN_STATUS = 0x67
+FAN_STATUS_REPORT_SPEED = 0x02
+FAN_STATUS_REPORT_VOLTAGE = 0x04
+
+OUTPUT_REPORT_ID_INIT_COMMAND = 0x60
+OUTPUT_REPORT_ID_SET_FAN_SPEED = 0x62
+INIT_COMMAND_DETECT_FANS = 0x03
+
+PWM_ENABLE_MANUAL = 1
+PWM_ENABLE_POLICY = 4
+
+FAN_CHANNELS = 3
+FAN_CHANNELS_MAX = 8
+# report_id, type/magic, unknown_static_data
+FAN_TYPE_OFFSET = 16
+STATUS_DATA_OFFSET = FAN_TYPE_OFFSET + FAN_CHANNELS_MAX
+
+# <linux/uhid.h>
+UHID_DESTROY = 1
+UHID_OUTPUT = 6
+UHID_CREATE2 = 11
+UHID_INPUT2 = 12
+UHID_DATA_MAX = 4096
+HID_MAX_DESCRIPTOR_SIZE = 4096
+UHID_EVENT_SIZE = 4 + 128 + 64 + 64 + 2 + 2 + 4 * 4 + HID_MAX_DESCRIPTOR_SIZE
+BUS_USB = 0x03
+
+# <linux/bpf.h>
+BPF_PROG_LOAD = 5
+BPF_OBJ_GET_INFO_BY_FD = 15
+BPF_RAW_TRACEPOINT_OPEN = 17
+BPF_BTF_GET_FD_BY_ID = 19
+BPF_BTF_GET_NEXT_ID = 23
+BPF_PROG_TYPE_TRACING = 26
+BPF_MODIFY_RETURN = 26
+# Enough for all commands used here, the rest must be zero
+BPF_ATTR_SIZE = 128
+BPF_ALU64_MOV_K = 0xb7
+BPF_JMP_EXIT = 0x95
+BPF_LOG_SIZE = 65536
+
+BTF_MAGIC = 0xeb9f
+BTF_KIND_FUNC = 12
+# Size of data following struct btf_type, by kind, for vlen
+BTF_KIND_EXTRA = {
+	1: lambda vlen: 4,		# INT
+	3: lambda vlen: 12,		# ARRAY
+	4: lambda vlen: 12 * vlen,	# STRUCT
+	5: lambda vlen: 12 * vlen,	# UNION
+	6: lambda vlen: 8 * vlen,	# ENUM
+	13: lambda vlen: 8 * vlen,	# FUNC_PROTO
+	14: lambda vlen: 4,		# VAR
+	15: lambda vlen: 12 * vlen,	# DATASEC
+	17: lambda vlen: 4,		# DECL_TAG
+	19: lambda vlen: 12 * vlen,	# ENUM64
+}
+
+SYS_BPF = {'x86_64': 321, 'aarch64': 280, 'i686': 357, 'armv7l': 386, 'riscv64': 280}
+
+MODULE_NAME = 'nzxt_smart2'
+POLICY_HOOK = 'nzxt_smart2_fan_policy'
+# The hook's return value is the duty cycle plus this
+POLICY_DUTY_OFFSET = 1
+
+
+class Capture:
+	def __init__(self):
+		self.descriptor = None
+		self.vendor = None
+		self.product = None
+		# (timestamp in seconds, report bytes)
+		self.reports = []
+
+
+def read_pcapng_packets(input):
+	"""Yields packet data from all Enhanced Packet Blocks."""
+	data = input.read()
+	offset = 0
+	linktypes = []
+
+	while offset + 12 <= len(data):
+		block_type, block_len = struct.unpack_from('<II', data, offset)
+		if block_len < 12:
+			raise ValueError(f'Invalid block length {block_len} at offset {offset}')
+
+		if block_type == 0x0a0d0d0a:
+			magic, = struct.unpack_from('<I', data, offset + 8)
+			if magic != 0x1a2b3c4d:
+				raise ValueError('Only little-endian pcapng files are supported')
+			linktypes = []
+
+		elif block_type == 0x00000001:
+			linktype, = struct.unpack_from('<H', data, offset + 8)
+			linktypes.append(linktype)
+
+		elif block_type == 0x00000006:
+			interface, _, _, captured_len, _ = struct.unpack_from('<IIIII', data, offset + 8)
+			if linktypes[interface] != LINKTYPE_USB_LINUX_MMAPPED:
+				raise ValueError(f'Unsupported link type {linktypes[interface]}')
+
+			yield data[offset + 28:offset + 28 + captured_len]
+
+		offset += block_len
+
+
+def parse_capture(input):
+	capture = Capture()
+	setups = {}
+
+	for packet in read_pcapng_packets(input):
+		(urb_id, event, xfer_type, epnum, devnum, busnum, flag_setup, flag_data,
+			ts_sec, ts_usec, status, length, len_cap, setup,
+			_, _, _, _) = USBMON_HEADER.unpack_from(packet)
+		payload = packet[64:64 + len_cap]
+		timestamp = ts_sec + ts_usec / 1000000
+
+		if xfer_type == XFER_TYPE_CONTROL:
+			if event == b'S' and flag_setup == b'\0':
+				setups[urb_id] = setup
+				continue
+
+			setup = setups.pop(urb_id, None)
+			if event != b'C' or status != 0 or setup is None:
+				continue
+
+			request_type, request, value = struct.unpack_from('<BBH', setup)
+			if request_type & 0x80 == 0 or request != 0x06:
+				continue
+
+			if value >> 8 == USB_DT_DEVICE and len(payload) >= 12:
+				capture.vendor, capture.product = struct.unpack_from('<HH', payload, 8)
+
+			elif value >> 8 == HID_DT_REPORT:
+				capture.descriptor = payload
+
+		elif xfer_type == XFER_TYPE_INTERRUPT:
+			if event == b'C' and epnum & 0x80 and status == 0 and payload:
+				capture.reports.append((timestamp, payload))
+
+	if capture.descriptor is None:
+		raise ValueError('No HID report descriptor in the capture')
+
+	if capture.vendor is None:
+		raise ValueError('No device descriptor in the capture')
+
+	return capture
+
+
+class ExpectedValues:
+	"""Values the driver should report after the given reports."""
+
+	def __init__(self):
+		self.fan_type = None
+		self.rpm = None
+		self.duty_percent = None
+		self.fan_in = None
+		self.fan_curr = None
+		self.samples = 0
+		self.sample_types = 0
+
+	def update(self, report):
+		if report[0] == INPUT_REPORT_ID_FAN_CONFIG:
+			self.fan_type = list(report[FAN_TYPE_OFFSET:FAN_TYPE_OFFSET + FAN_CHANNELS])
+			return
+
+		if report[0] != INPUT_REPORT_ID_FAN_STATUS or self.fan_type is None:
+			return
+
+		values = struct.unpack_from(f'<{FAN_CHANNELS_MAX}H{FAN_CHANNELS_MAX}H', report,
+					    STATUS_DATA_OFFSET)
+
+		if report[1] == FAN_STATUS_REPORT_SPEED:
+			self.rpm = list(values[:FAN_CHANNELS])
+			offset = STATUS_DATA_OFFSET + 2 * FAN_CHANNELS_MAX
+			self.duty_percent = list(report[offset:offset + FAN_CHANNELS])
+
+		elif report[1] == FAN_STATUS_REPORT_VOLTAGE:
+			self.fan_in = list(values[:FAN_CHANNELS])
+			self.fan_curr = list(values[FAN_CHANNELS_MAX:FAN_CHANNELS_MAX + FAN_CHANNELS])
+
+		else:
+			return
+
+		if self.sample_types & report[1]:
+			self.sample_types = 0
+
+		self.sample_types |= report[1]
+		if self.sample_types == FAN_STATUS_REPORT_SPEED | FAN_STATUS_REPORT_VOLTAGE:
+			self.sample_types = 0
+			self.samples += 1
+
+	def attributes(self):
+		"""Returns {sysfs attribute name: expected value}."""
+		result = {}
+
+		for i in range(FAN_CHANNELS):
+			if self.rpm is not None:
+				result[f'fan{i + 1}_input'] = self.rpm[i]
+				result[f'pwm{i + 1}'] = scale_pwm_value(self.duty_percent[i], 100, 255)
+
+			if self.fan_in is not None:
+				result[f'in{i}_input'] = self.fan_in[i]
+				result[f'curr{i + 1}_input'] = self.fan_curr[i]
+
+		return result
+
+
+def scale_pwm_value(val, orig_max, new_max):
+	"""Same as scale_pwm_value() in the driver."""
+	if val <= 0:
+		return 0
+
+	val = min(val, orig_max) * new_max
+	return max(1, (val + orig_max // 2) // orig_max)
+
+
+class Uhid:
+	def __init__(self, capture, phys):
+		self.fd = os.open('/dev/uhid', os.O_RDWR | os.O_CLOEXEC)
+
+		name = f'NZXT replay {capture.vendor:04x}:{capture.product:04x}'
+		self.write_event(struct.pack(
+			'<I128s64s64sHHIIII',
+			UHID_CREATE2, name.encode(), phys.encode(), b'',
+			len(capture.descriptor), BUS_USB, capture.vendor, capture.product, 0, 0
+		) + capture.descriptor)
+
+	def write_event(self, event):
+		os.write(self.fd, event.ljust(UHID_EVENT_SIZE, b'\0'))
+
+	def input(self, report):
+		self.write_event(struct.pack('<IH', UHID_INPUT2, len(report)) + report)
+
+	def read_output(self, timeout):
+		"""Returns the next output report, or None on timeout."""
+		deadline = time.monotonic() + timeout
+
+		while True:
+			remaining = max(0, deadline - time.monotonic())
+			if not select.select([self.fd], [], [], remaining)[0]:
+				return None
+
+			event = os.read(self.fd, UHID_EVENT_SIZE)
+			event_type, = struct.unpack_from('<I', event)
+			if event_type != UHID_OUTPUT:
+				continue
+
+			size, = struct.unpack_from('<H', event, 4 + UHID_DATA_MAX)
+			return event[4:4 + size]
+
+	def drain_output(self):
+		"""Returns all queued output reports."""
+		reports = []
+
+		while True:
+			report = self.read_output(0)
+			if report is None:
+				return reports
+
+			reports.append(report)
+
+	def destroy(self):
+		self.write_event(struct.pack('<I', UHID_DESTROY))
+		os.close(self.fd)
+
+
+libc = ctypes.CDLL(None, use_errno=True)
+
+
+def bpf(cmd, attr):
+	"""bpf() syscall. Returns the result and the (updated) attributes."""
+	buf = ctypes.create_string_buffer(attr, BPF_ATTR_SIZE)
+	ret = libc.syscall(SYS_BPF[platform.machine()], cmd, buf, BPF_ATTR_SIZE)
+	if ret < 0:
+		errno = ctypes.get_errno()
+		raise OSError(errno, f'bpf({cmd}): {os.strerror(errno)}')
+
+	return ret, buf.raw
+
+
+def read_btf(path):
+	"""Returns (types, strings) sections of BTF data."""
+	with open(path, 'rb') as f:
+		data = f.read()
+
+	magic, _, _, hdr_len, type_off, type_len, str_off, str_len = struct.unpack_from(
+		'<HBBIIIII', data)
+	if magic != BTF_MAGIC:
+		raise ValueError(f'{path}: not BTF data')
+
+	return (data[hdr_len + type_off:hdr_len + type_off + type_len],
+		data[hdr_len + str_off:hdr_len + str_off + str_len])
+
+
+def btf_types(types):
+	"""Yields (name offset, kind) of all types."""
+	offset = 0
+
+	while offset < len(types):
+		name_off, info = struct.unpack_from('<II', types, offset)
+		kind = (info >> 24) & 0x1f
+		vlen = info & 0xffff
+		offset += 12 + BTF_KIND_EXTRA.get(kind, lambda vlen: 0)(vlen)
+
+		yield name_off, kind
+
+
+def find_btf_func(module, name):
+	"""
+	Returns BTF type id of a function in module's BTF. Module BTF is split
+	BTF: its type ids and string offsets continue those of vmlinux.
+	"""
+	base_types, base_strings = read_btf('/sys/kernel/btf/vmlinux')
+	types, strings = read_btf(f'/sys/kernel/btf/{module}')
+
+	type_id = sum(1 for _ in btf_types(base_types))
+	name = name.encode()
+
+	for name_off, kind in btf_types(types):
+		type_id += 1
+		if kind != BTF_KIND_FUNC or name_off < len(base_strings):
+			continue
+
+		name_off -= len(base_strings)
+		if strings[name_off:strings.index(b'\0', name_off)] == name:
+			return type_id
+
+	raise ValueError(f'{name.decode()} not found in {module} BTF')
+
+
+def module_btf_fd(module):
+	"""Returns a file descriptor of module's BTF object."""
+	btf_id = 0
+	name = ctypes.create_string_buffer(64)
+	info = ctypes.create_string_buffer(32)
+
+	while True:
+		try:
+			_, attr = bpf(BPF_BTF_GET_NEXT_ID, struct.pack('<I', btf_id))
+		except FileNotFoundError:
+			raise ValueError(f'No BTF object for {module} module') from None
+
+		btf_id, = struct.unpack_from('<I', attr, 4)
+		fd, _ = bpf(BPF_BTF_GET_FD_BY_ID, struct.pack('<I', btf_id))
+
+		# struct bpf_btf_info: btf, btf_size, id, name, name_len, kernel_btf
+		ctypes.memmove(info, struct.pack('<QIIQII', 0, 0, 0, ctypes.addressof(name),
+						 len(name), 0), len(info))
+		bpf(BPF_OBJ_GET_INFO_BY_FD, struct.pack('<IIQ', fd, len(info), ctypes.addressof(info)))
+
+		if name.value == module.encode():
+			return fd
+
+		os.close(fd)
+
+
+class FanPolicy:
+	"""BPF fan policy (fmod_ret program) that always returns the same duty cycle."""
+
+	def __init__(self, duty_percent):
+		btf_id = find_btf_func(MODULE_NAME, POLICY_HOOK)
+		self.btf_fd = module_btf_fd(MODULE_NAME)
+
+		insns = (struct.pack('<BBhi', BPF_ALU64_MOV_K, 0, 0, duty_percent + POLICY_DUTY_OFFSET) +
+			 struct.pack('<BBhi', BPF_JMP_EXIT, 0, 0, 0))
+		insns = ctypes.create_string_buffer(insns, len(insns))
+		license = ctypes.create_string_buffer(b'GPL')
+		log = ctypes.create_string_buffer(BPF_LOG_SIZE)
+
+		try:
+			self.prog_fd, _ = bpf(BPF_PROG_LOAD, struct.pack(
+				'<IIQQIIQII16sIIIIQIIQIII',
+				BPF_PROG_TYPE_TRACING, len(insns) // 8, ctypes.addressof(insns),
+				ctypes.addressof(license), 1, len(log), ctypes.addressof(log),
+				0, 0, b'nzxt_policy', 0, BPF_MODIFY_RETURN, 0, 0, 0, 0, 0, 0, 0,
+				btf_id, self.btf_fd))
+		except OSError as e:
+			os.close(self.btf_fd)
+			raise OSError(e.errno, f'{e.strerror}\n{log.value.decode()}') from None
+
+		self.link_fd, _ = bpf(BPF_RAW_TRACEPOINT_OPEN, struct.pack('<QI', 0, self.prog_fd))
+
+	def close(self):
+		os.close(self.link_fd)
+		os.close(self.prog_fd)
+		os.close(self.btf_fd)
+
+
+def policy_missing(outputs, channels, duty_percent):
+	"""Returns channels that didn't get the policy's duty cycle in outputs."""
+	return [
+		i for i in channels
+		if not any(report[0] == OUTPUT_REPORT_ID_SET_FAN_SPEED and len(report) > 3 + i and
+			   report[2] & (1 << i) and report[3 + i] == duty_percent
+			   for report in outputs)
+	]
+
+
+def find_hwmon(phys, timeout):
+	"""Finds hwmon directory of the HID device with the given phys."""
+	deadline = time.monotonic() + timeout
+
+	while time.monotonic() < deadline:
+		for device in os.listdir('/sys/bus/hid/devices'):
+			path = os.path.join('/sys/bus/hid/devices', device)
+
+			with open(os.path.join(path, 'uevent')) as uevent:
+				if f'HID_PHYS={phys}\n' not in uevent.read():
+					continue
+
+			hwmon = os.path.join(path, 'hwmon')
+			if os.path.isdir(hwmon):
+				for name in os.listdir(hwmon):
+					return os.path.join(hwmon, name)
+
+		time.sleep(0.01)
+
+	raise TimeoutError('hwmon device did not appear')
+
+
+def read_attribute(hwmon, name):
+	with open(os.path.join(hwmon, name)) as f:
+		return int(f.read())
+
+
+def write_attribute(hwmon, name, value):
+	with open(os.path.join(hwmon, name), 'w') as f:
+		f.write(str(value))
+
+
+def wait_detect_fans(uhid, timeout):
+	while True:
+		report = uhid.read_output(timeout)
+		if report is None:
+			raise TimeoutError('The driver did not send "detect fans" command')
+
+		if report[:2] == bytes([OUTPUT_REPORT_ID_INIT_COMMAND, INIT_COMMAND_DETECT_FANS]):
+			return
+
+
+def do_list(capture):
+	print(f'Device {capture.vendor:04x}:{capture.product:04x}, '
+	      f'report descriptor {len(capture.descriptor)} bytes')
+
+	start = capture.reports[0][0] if capture.reports else 0
+	for timestamp, report in capture.reports:
+		print(f'{timestamp - start:10.6f} {report.hex()}')
+
+
+def do_replay(capture, speed, timeout, policy):
+	config = [report for _, report in capture.reports if report[0] == INPUT_REPORT_ID_FAN_CONFIG]
+	status = [(timestamp, report) for timestamp, report in capture.reports
+		  if report[0] == INPUT_REPORT_ID_FAN_STATUS]
+
+	if not config:
+		raise ValueError('No fan config report in the capture')
+
+	expected = ExpectedValues()
+	phys = f'nzxt-smart2-replay-{os.getpid()}'
+	uhid = Uhid(capture, phys)
+	fan_policy = None
+	policy_channels = []
+	outputs = []
+
+	try:
+		wait_detect_fans(uhid, timeout)
+		uhid.input(config[0])
+		expected.update(config[0])
+
+		hwmon = find_hwmon(phys, timeout)
+
+		if policy is not None:
+			fan_policy = FanPolicy(policy)
+			policy_channels = [i for i in range(FAN_CHANNELS) if expected.fan_type[i]]
+
+			for i in policy_channels:
+				write_attribute(hwmon, f'pwm{i + 1}_enable', PWM_ENABLE_POLICY)
+
+			print(f'Policy returns {policy}% for channels {[i + 1 for i in policy_channels]}')
+
+		print(f'Replaying {len(status)} reports into {hwmon}')
+
+		sample_count_start = read_attribute(hwmon, 'sample_count')
+		capture_start = status[0][0]
+		replay_start = time.monotonic()
+
+		for i, (timestamp, report) in enumerate(status):
+			if speed:
+				delay = replay_start + (timestamp - capture_start) / speed - time.monotonic()
+				if delay > 0:
+					time.sleep(delay)
+
+			# Don't let the driver's output reports (like update interval changes) fill the queue
+			if i % 16 == 0:
+				outputs += uhid.drain_output()
+
+			uhid.input(report)
+			expected.update(report)
+
+		elapsed = time.monotonic() - replay_start
+		sample_count = read_attribute(hwmon, 'sample_count') - sample_count_start
+		samples = expected.samples
+		reports = len(status)
+
+		print(f'{reports} reports in {elapsed:.3f} s, '
+		      f'{reports / elapsed:.0f} reports/s, {elapsed / reports * 1e6:.1f} us/report')
+		print(f'sample_count increased by {sample_count}, expected {samples}')
+
+		errors = 0 if sample_count == samples else 1
+		for name, value in expected.attributes().items():
+			actual = read_attribute(hwmon, name)
+			if actual != value:
+				print(f'{name}: {actual}, expected {value}')
+				errors += 1
+
+		if fan_policy:
+			# Reports are sent by a work item, give it some time
+			deadline = time.monotonic() + timeout
+			missing = policy_missing(outputs, policy_channels, policy)
+
+			while missing and time.monotonic() < deadline:
+				report = uhid.read_output(deadline - time.monotonic())
+				if report is not None:
+					outputs.append(report)
+					missing = policy_missing(outputs, policy_channels, policy)
+
+			for i in missing:
+				print(f'pwm{i + 1}: no "set fan speed" report with {policy}% '
+				      f'(is it the duty cycle from the capture?)')
+
+			errors += len(missing)
+
+			for i in policy_channels:
+				write_attribute(hwmon, f'pwm{i + 1}_enable', PWM_ENABLE_MANUAL)
+
+		if errors:
+			print(f'{errors} mismatches')
+		else:
+			print('All values match')
+
+		return errors
+
+	finally:
+		if fan_policy:
+			fan_policy.close()
+
+		uhid.destroy()
+
+
+def main():
+	import argparse
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--list', action='store_true',
+			    help='print reports from the capture, don\'t replay them')
+	parser.add_argument('--speed', type=float, default=1.0,
+			    help='timing: 1 - original, >1 - accelerated, 0 - as fast as possible')
+	parser.add_argument('--timeout', type=float, default=5.0,
+			    help='how long to wait for the driver (in seconds)')
+	parser.add_argument('--policy', type=int, metavar='DUTY',
+			    help='attach a BPF fan policy returning DUTY percent, check '
+				 'that the driver applies it')
+	parser.add_argument('input', type=argparse.FileType('rb'))
+	args = parser.parse_args()
+
+	if args.speed < 0:
+		parser.error('speed must not be negative')
+
+	if args.policy is not None and not 0 <= args.policy <= 100:
+		parser.error('policy duty cycle must be 0-100')
+
+	capture = parse_capture(args.input)
+
+	if args.list:
+		do_list(capture)
+		return 0
+
+	return 1 if do_replay(capture, args.speed, args.timeout, args.policy) else 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,285 @@
+#!/usr/bin/env python3
+"""
+Simulates an NZXT RGB & Fan Controller (1e71:2009) through /dev/uhid, for
+testing the nzxt-smart2 driver without the device.
+
+The report descriptor is taken from usbhid-dump.txt. Like the real device, the
+simulator answers "detect fans" command (0x60 0x03) with a fan config report
+(0x61), changes its update interval on 0x60 0x02, applies duty cycles from
+0x62 reports, and sends a pair of status reports (0x67, speed and voltage)
+every update interval. Fan speed, voltage and current follow the duty cycle.
+"""
+
+import os
+import struct
+import sys
+import threading
+import time
+
+from replay import (
+	FAN_CHANNELS, FAN_CHANNELS_MAX, FAN_STATUS_REPORT_SPEED, FAN_STATUS_REPORT_VOLTAGE,
+	INIT_COMMAND_DETECT_FANS, INPUT_REPORT_ID_FAN_CONFIG, INPUT_REPORT_ID_FAN_STATUS,
+	OUTPUT_REPORT_ID_INIT_COMMAND, Uhid, find_hwmon,
+)
+
+
+VENDOR = 0x1e71
+PRODUCT = 0x2009
+
+DESCRIPTOR_FILE = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'usbhid-dump.txt')
+
+OUTPUT_REPORT_ID_SET_FAN_SPEED = 0x62
+INIT_COMMAND_SET_UPDATE_INTERVAL = 0x02
+
+FAN_TYPE_NONE = 0
+FAN_TYPE_DC = 1
+FAN_TYPE_PWM = 2
+
+FAN_TYPES = {'none': FAN_TYPE_NONE, 'dc': FAN_TYPE_DC, 'pwm': FAN_TYPE_PWM}
+
+REPORT_SIZE = 64
+
+# Bytes 2-15 of all input reports from the capture
+UNKNOWN_STATIC_DATA = bytes.fromhex('230030000351564e343535200300')
+
+# The device's update interval after power on, in seconds
+DEFAULT_INTERVAL = 1.0
+
+
+def read_descriptor(path=DESCRIPTOR_FILE):
+	"""Reads the report descriptor from usbhid-dump output."""
+	descriptor = bytearray()
+	found = False
+
+	with open(path) as dump:
+		for line in dump:
+			if 'DESCRIPTOR' in line:
+				found = True
+				continue
+
+			if found:
+				if not line.strip():
+					break
+
+				descriptor += bytes.fromhex(line)
+
+	if not descriptor:
+		raise ValueError(f'No report descriptor in {path}')
+
+	return bytes(descriptor)
+
+
+def control_byte_to_update_interval(control_byte):
+	"""Same as control_byte_to_update_interval() in the driver, in milliseconds."""
+	if control_byte == 0:
+		return 250
+
+	return 488 + (control_byte - 1) * 256
+
+
+class Simulator:
+	def __init__(self, fan_type, interval=None, max_rpm=2000, phys=None):
+		self.descriptor = read_descriptor()
+		self.vendor = VENDOR
+		self.product = PRODUCT
+		self.phys = phys or f'nzxt-smart2-simulator-{os.getpid()}-{id(self)}'
+
+		self.fan_type = list(fan_type)
+		self.max_rpm = max_rpm
+		self.duty = [40] * FAN_CHANNELS
+		# Fixed report interval (seconds), or None to follow the driver's requests
+		self.fixed_interval = interval
+		self.interval = DEFAULT_INTERVAL if interval is None else interval
+
+		# All output reports received from the driver
+		self.outputs = []
+		# monotonic() time right before the first status report was sent
+		self.first_report_time = None
+		self.status_reports = 0
+		self.detected = False
+
+		self.cond = threading.Condition()
+		self.stopping = False
+		self.thread = None
+		self.uhid = None
+
+	def fan_values(self, channel):
+		"""Returns (rpm, millivolts, milliamperes) of a channel."""
+		duty = self.duty[channel]
+
+		if self.fan_type[channel] == FAN_TYPE_NONE:
+			return 0, 12000, 0
+
+		rpm = duty * self.max_rpm // 100
+		if self.fan_type[channel] == FAN_TYPE_DC:
+			# Voltage control, 9-12V
+			return rpm, (9000 + duty * 30) if duty else 0, duty * 2
+
+		return rpm, 12000, 20 + duty
+
+	def header(self, report_id, report_type):
+		fan_type = bytes(self.fan_type).ljust(FAN_CHANNELS_MAX, b'\0')
+		return bytes([report_id, report_type]) + UNKNOWN_STATIC_DATA + fan_type
+
+	def fan_config_report(self):
+		return self.header(INPUT_REPORT_ID_FAN_CONFIG, INIT_COMMAND_DETECT_FANS).ljust(
+			REPORT_SIZE, b'\0')
+
+	def speed_report(self):
+		values = [self.fan_values(i) for i in range(FAN_CHANNELS)]
+		rpm = [value[0] for value in values] + [0] * (FAN_CHANNELS_MAX - FAN_CHANNELS)
+		duty = bytes(self.duty).ljust(FAN_CHANNELS_MAX, b'\0')
+
+		report = self.header(INPUT_REPORT_ID_FAN_STATUS, FAN_STATUS_REPORT_SPEED)
+		report += struct.pack(f'<{FAN_CHANNELS_MAX}H', *rpm) + duty + duty
+		return report.ljust(REPORT_SIZE, b'\0')
+
+	def voltage_report(self):
+		values = [self.fan_values(i) for i in range(FAN_CHANNELS)]
+		padding = [0] * (FAN_CHANNELS_MAX - FAN_CHANNELS)
+		fan_in = [value[1] for value in values] + padding
+		fan_curr = [value[2] for value in values] + padding
+
+		report = self.header(INPUT_REPORT_ID_FAN_STATUS, FAN_STATUS_REPORT_VOLTAGE)
+		report += struct.pack(f'<{FAN_CHANNELS_MAX}H{FAN_CHANNELS_MAX}H', *fan_in, *fan_curr)
+		return report.ljust(REPORT_SIZE, b'\0')
+
+	def handle_output(self, report):
+		if report[0] == OUTPUT_REPORT_ID_INIT_COMMAND and len(report) >= 2:
+			if report[1] == INIT_COMMAND_DETECT_FANS:
+				self.uhid.input(self.fan_config_report())
+				self.detected = True
+
+			elif report[1] == INIT_COMMAND_SET_UPDATE_INTERVAL and len(report) >= 5:
+				if self.fixed_interval is None:
+					self.interval = control_byte_to_update_interval(report[4]) / 1000
+
+		elif report[0] == OUTPUT_REPORT_ID_SET_FAN_SPEED and len(report) >= 3 + FAN_CHANNELS:
+			for i in range(FAN_CHANNELS):
+				if report[2] & (1 << i):
+					self.duty[i] = report[3 + i]
+
+		with self.cond:
+			self.outputs.append(bytes(report))
+			self.cond.notify_all()
+
+	def send_status(self):
+		now = time.monotonic()
+
+		# Readers can wake up before uhid.input() returns
+		with self.cond:
+			if self.first_report_time is None:
+				self.first_report_time = now
+
+		self.uhid.input(self.speed_report())
+		self.uhid.input(self.voltage_report())
+
+		with self.cond:
+			self.status_reports += 2
+			self.cond.notify_all()
+
+	def run(self):
+		next_report = None
+
+		while not self.stopping:
+			now = time.monotonic()
+
+			# Like the device, report only after fan detection
+			if self.detected and next_report is None:
+				next_report = now + self.interval
+
+			if next_report is not None and now >= next_report:
+				self.send_status()
+				next_report = max(next_report + self.interval, now)
+				continue
+
+			timeout = 0.05 if next_report is None else min(0.05, next_report - now)
+			report = self.uhid.read_output(timeout)
+			if report is not None:
+				self.handle_output(report)
+
+	def start(self):
+		self.uhid = Uhid(self, self.phys)
+		self.thread = threading.Thread(target=self.run, daemon=True)
+		self.thread.start()
+
+	def stop(self):
+		self.stopping = True
+		self.thread.join()
+		self.uhid.destroy()
+
+	def wait_output(self, predicate, timeout, start=0):
+		"""
+		Waits for an output report matching predicate (starting from
+		outputs[start]), returns it or None.
+		"""
+		deadline = time.monotonic() + timeout
+		checked = start
+
+		with self.cond:
+			while True:
+				for report in self.outputs[checked:]:
+					if predicate(report):
+						return report
+
+				checked = len(self.outputs)
+				remaining = deadline - time.monotonic()
+				if remaining <= 0:
+					return None
+
+				self.cond.wait(remaining)
+
+	def hwmon(self, timeout):
+		return find_hwmon(self.phys, timeout)
+
+
+def parse_fan_types(value):
+	types = [FAN_TYPES[name] for name in value.split(',')]
+	if len(types) != FAN_CHANNELS:
+		raise ValueError(f'{FAN_CHANNELS} fan types expected')
+
+	return types
+
+
+def main():
+	import argparse
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--fans', type=parse_fan_types, default='pwm,dc,none',
+			    help='fan types (pwm, dc or none) of the 3 channels')
+	parser.add_argument('--interval', type=float,
+			    help='report interval in seconds (default: follow the driver)')
+	parser.add_argument('--max-rpm', type=int, default=2000,
+			    help='fan speed at 100%% duty cycle')
+	parser.add_argument('--verbose', action='store_true',
+			    help='print output reports received from the driver')
+	args = parser.parse_args()
+
+	simulator = Simulator(args.fans, args.interval, args.max_rpm)
+	simulator.start()
+
+	try:
+		print(f'Simulating {VENDOR:04x}:{PRODUCT:04x} at {simulator.hwmon(5.0)}')
+
+		printed = 0
+		while True:
+			time.sleep(0.1)
+
+			if args.verbose:
+				with simulator.cond:
+					outputs = simulator.outputs[printed:]
+					printed += len(outputs)
+
+				for report in outputs:
+					print(f'output: {report.hex()}')
+
+	except KeyboardInterrupt:
+		pass
+
+	finally:
+		simulator.stop()
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * KUnit tests for nzxt-smart2 driver: report parsers, pwm scaling and update
+ * interval mapping. No hardware is needed, the parsers are fed synthetic
+ * reports.
+ *
+ * This file is included by nzxt-smart2.c (it tests static functions), when
+ * Kbuild defines NZXT_SMART2_KUNIT_TEST (make KUNIT=1). The suite runs when the
+ * module is loaded.
+ */
+
+#include <kunit/test.h>
+
+/*
+ * Before 6.0, kunit_test_suites() in a module defines module_init() and
+ * module_exit(), which conflict with the driver's.
+ */
+#if KERNEL_VERSION(6, 0, 0) > LINUX_VERSION_CODE
+#error "KUnit tests of nzxt-smart2 need Linux 6.0 or newer"
+#endif
+
+#define TEST_BENCH_REPORTS 10000
+
+static struct drvdata *test_drvdata(struct kunit *test)
+{
+	struct drvdata *drvdata = kunit_kzalloc(test, sizeof(*drvdata), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, drvdata);
+
+	/* For log messages, like boot_timing */
+	drvdata->hid = kunit_kzalloc(test, sizeof(*drvdata->hid), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, drvdata->hid);
+
+	init_waitqueue_head(&drvdata->wq);
+	seqcount_spinlock_init(&drvdata->sample_seq, &drvdata->wq.lock);
+	drvdata->update_interval = UPDATE_INTERVAL_DEFAULT_MS;
+
+	return drvdata;
+}
+
+static const u8 test_fan_types[FAN_CHANNELS_MAX] = {
+	FAN_TYPE_PWM, FAN_TYPE_DC, FAN_TYPE_NONE,
+};
+
+static void test_fan_config_report(struct fan_config_report *report)
+{
+	memset(report, 0, sizeof(*report));
+	report->report_id = INPUT_REPORT_ID_FAN_CONFIG;
+	report->magic = 0x03;
+	memcpy(report->fan_type, test_fan_types, sizeof(report->fan_type));
+}
+
+static void test_speed_report(struct fan_status_report *report)
+{
+	int i;
+
+	memset(report, 0, sizeof(*report));
+	report->report_id = INPUT_REPORT_ID_FAN_STATUS;
+	report->type = FAN_STATUS_REPORT_SPEED;
+	memcpy(report->fan_type, test_fan_types, sizeof(report->fan_type));
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		put_unaligned_le16(1000 + i, &report->fan_speed.fan_rpm[i]);
+		report->fan_speed.duty_percent[i] = 40 + i;
+		report->fan_speed.duty_percent_dup[i] = 40 + i;
+	}
+}
+
+static void test_voltage_report(struct fan_status_report *report)
+{
+	int i;
+
+	memset(report, 0, sizeof(*report));
+	report->report_id = INPUT_REPORT_ID_FAN_STATUS;
+	report->type = FAN_STATUS_REPORT_VOLTAGE;
+	memcpy(report->fan_type, test_fan_types, sizeof(report->fan_type));
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		put_unaligned_le16(12000 - i, &report->fan_voltage.fan_in[i]);
+		put_unaligned_le16(100 + i, &report->fan_voltage.fan_current[i]);
+	}
+}
+
+static void test_accept_fan_config(struct kunit *test, struct drvdata *drvdata)
+{
+	struct fan_config_report report;
+
+	test_fan_config_report(&report);
+	KUNIT_ASSERT_EQ(test, (int)handle_fan_config_report(drvdata, &report,
+							     sizeof(report)),
+			(int)NZXT_SMART2_RAW_EVENT_ACCEPTED);
+}
+
+static void nzxt_smart2_test_fan_config(struct kunit *test)
+{
+	struct drvdata *drvdata = test_drvdata(test);
+	struct fan_config_report report;
+	int i, size;
+
+	test_fan_config_report(&report);
+
+	for (size = 0; size < sizeof(report); size++)
+		KUNIT_EXPECT_EQ(test, (int)handle_fan_config_report(drvdata, &report, size),
+				(int)NZXT_SMART2_RAW_EVENT_BAD_SIZE);
+
+	report.magic = 0x02;
+	KUNIT_EXPECT_EQ(test, (int)handle_fan_config_report(drvdata, &report,
+							     sizeof(report)),
+			(int)NZXT_SMART2_RAW_EVENT_BAD_MAGIC);
+
+	KUNIT_EXPECT_FALSE(test, drvdata->fan_config_received);
+
+	test_accept_fan_config(test, drvdata);
+	KUNIT_EXPECT_TRUE(test, drvdata->fan_config_received);
+
+	for (i = 0; i < FAN_CHANNELS; i++)
+		KUNIT_EXPECT_EQ(test, (int)drvdata->fan_type[i], (int)test_fan_types[i]);
+}
+
+static void nzxt_smart2_test_fan_status(struct kunit *test)
+{
+	struct drvdata *drvdata = test_drvdata(test);
+	struct fan_status_report report;
+	int i;
+
+	/* Status reports are dropped until fan detection completes */
+	test_speed_report(&report);
+	KUNIT_EXPECT_EQ(test, (int)handle_fan_status_report(drvdata, &report,
+							     sizeof(report)),
+			(int)NZXT_SMART2_RAW_EVENT_NOT_READY);
+
+	test_accept_fan_config(test, drvdata);
+
+	KUNIT_EXPECT_EQ(test, (int)handle_fan_status_report(drvdata, &report,
+							     sizeof(report)),
+			(int)NZXT_SMART2_RAW_EVENT_ACCEPTED);
+	KUNIT_EXPECT_TRUE(test, drvdata->pwm_status_received);
+	KUNIT_EXPECT_EQ(test, drvdata->sample_count, 0ULL);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		KUNIT_EXPECT_EQ(test, (int)drvdata->fan_rpm[i], 1000 + i);
+		KUNIT_EXPECT_EQ(test, (int)drvdata->fan_duty_percent[i], 40 + i);
+	}
+
+	test_voltage_report(&report);
+	KUNIT_EXPECT_EQ(test, (int)handle_fan_status_report(drvdata, &report,
+							     sizeof(report)),
+			(int)NZXT_SMART2_RAW_EVENT_ACCEPTED);
+	KUNIT_EXPECT_TRUE(test, drvdata->voltage_status_received);
+	/* Speed and voltage make a complete sample */
+	KUNIT_EXPECT_EQ(test, drvdata->sample_count, 1ULL);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		KUNIT_EXPECT_EQ(test, (int)drvdata->fan_in[i], 12000 - i);
+		KUNIT_EXPECT_EQ(test, (int)drvdata->fan_curr[i], 100 + i);
+		KUNIT_EXPECT_EQ(test, drvdata->fan_power[i],
+				(u32)(12000 - i) * (100 + i));
+	}
+
+	report.type = 0x03;
+	KUNIT_EXPECT_EQ(test, (int)handle_fan_status_report(drvdata, &report,
+							     sizeof(report)),
+			(int)NZXT_SMART2_RAW_EVENT_IGNORED);
+	KUNIT_EXPECT_EQ(test, drvdata->sample_count, 1ULL);
+}
+
+static void nzxt_smart2_test_fan_status_truncated(struct kunit *test)
+{
+	struct drvdata *drvdata = test_drvdata(test);
+	struct fan_status_report report;
+	int size;
+
+	test_accept_fan_config(test, drvdata);
+
+	test_speed_report(&report);
+	for (size = 0; size < sizeof(report); size++)
+		KUNIT_EXPECT_EQ(test, (int)handle_fan_status_report(drvdata, &report, size),
+				(int)NZXT_SMART2_RAW_EVENT_BAD_SIZE);
+
+	test_voltage_report(&report);
+	for (size = 0; size < sizeof(report); size++)
+		KUNIT_EXPECT_EQ(test, (int)handle_fan_status_report(drvdata, &report, size),
+				(int)NZXT_SMART2_RAW_EVENT_BAD_SIZE);
+
+	/* Truncated reports don't change anything */
+	KUNIT_EXPECT_FALSE(test, drvdata->pwm_status_received);
+	KUNIT_EXPECT_FALSE(test, drvdata->voltage_status_received);
+	KUNIT_EXPECT_EQ(test, (int)drvdata->fan_rpm[0], 0);
+	KUNIT_EXPECT_EQ(test, (int)drvdata->fan_in[0], 0);
+}
+
+static void nzxt_smart2_test_scale_pwm(struct kunit *test)
+{
+	long val;
+
+	KUNIT_EXPECT_EQ(test, scale_pwm_value(0, 255, 100), 0L);
+	KUNIT_EXPECT_EQ(test, scale_pwm_value(-1, 255, 100), 0L);
+	KUNIT_EXPECT_EQ(test, scale_pwm_value(255, 255, 100), 100L);
+	KUNIT_EXPECT_EQ(test, scale_pwm_value(1000, 255, 100), 100L);
+	KUNIT_EXPECT_EQ(test, scale_pwm_value(100, 100, 255), 255L);
+
+	/* 0 turns the fan off, positive values must not round to it */
+	KUNIT_EXPECT_EQ(test, scale_pwm_value(1, 255, 100), 1L);
+
+	/* percent -> pwm -> percent is lossless */
+	for (val = 0; val <= 100; val++)
+		KUNIT_EXPECT_EQ(test,
+				scale_pwm_value(scale_pwm_value(val, 100, 255), 255, 100),
+				val);
+
+	/* pwm -> percent is monotonic */
+	for (val = 1; val <= 255; val++)
+		KUNIT_EXPECT_LE(test, scale_pwm_value(val - 1, 255, 100),
+				scale_pwm_value(val, 255, 100));
+}
+
+static void nzxt_smart2_test_interval_nominal(struct kunit *test)
+{
+	struct drvdata *drvdata = test_drvdata(test);
+	long interval;
+	int control;
+
+	/* Values from the table above control_byte_to_update_interval() */
+	KUNIT_EXPECT_EQ(test, control_byte_to_update_interval(0x00), 250L);
+	KUNIT_EXPECT_EQ(test, control_byte_to_update_interval(0x01), 488L);
+	KUNIT_EXPECT_EQ(test, control_byte_to_update_interval(0x02), 744L);
+	KUNIT_EXPECT_EQ(test, control_byte_to_update_interval(0x03), 1000L);
+	KUNIT_EXPECT_EQ(test, control_byte_to_update_interval(0x07), 2024L);
+	KUNIT_EXPECT_EQ(test, control_byte_to_update_interval(0xff), 65512L);
+
+	/* Out of range intervals are clamped */
+	KUNIT_EXPECT_EQ(test, (int)update_interval_to_control_byte(drvdata, 0, false), 0);
+	KUNIT_EXPECT_EQ(test, (int)update_interval_to_control_byte(drvdata, 1000000, false),
+			0xff);
+
+	for (control = 0; control <= U8_MAX; control++) {
+		interval = control_byte_to_update_interval(control);
+
+		/* control byte -> interval -> control byte is lossless */
+		KUNIT_EXPECT_EQ(test,
+				(int)update_interval_to_control_byte(drvdata, interval, false),
+				control);
+		KUNIT_EXPECT_EQ(test,
+				(int)update_interval_to_control_byte(drvdata, interval, true),
+				control);
+		KUNIT_EXPECT_EQ(test, measured_update_interval(drvdata, control),
+				interval);
+
+		/* Rounding down never picks a longer interval */
+		if (control)
+			KUNIT_EXPECT_EQ(test,
+					(int)update_interval_to_control_byte(drvdata,
+									     interval - 1,
+									     true),
+					control - 1);
+	}
+}
+
+static void nzxt_smart2_test_interval_calibrated(struct kunit *test)
+{
+	struct drvdata *drvdata = test_drvdata(test);
+
+	/* Too few samples, nominal intervals are used */
+	drvdata->calibration[3] = (struct interval_calibration) {
+		.sum_us = 1010000 * (CALIBRATION_MIN_SAMPLES - 1),
+		.count = CALIBRATION_MIN_SAMPLES - 1,
+	};
+	KUNIT_EXPECT_EQ(test, measured_update_interval(drvdata, 3), 1000L);
+
+	drvdata->calibration[1] = (struct interval_calibration) {
+		.sum_us = 500000 * CALIBRATION_MIN_SAMPLES,
+		.count = CALIBRATION_MIN_SAMPLES,
+	};
+	drvdata->calibration[3] = (struct interval_calibration) {
+		.sum_us = 1010000 * CALIBRATION_MIN_SAMPLES,
+		.count = CALIBRATION_MIN_SAMPLES,
+	};
+	/* As report_timing_update() does */
+	drvdata->interval_map_valid = false;
+
+	/* Measured control bytes use the average */
+	KUNIT_EXPECT_EQ(test, measured_update_interval(drvdata, 1), 500L);
+	KUNIT_EXPECT_EQ(test, measured_update_interval(drvdata, 3), 1010L);
+	/* Others use the fit: 245 ms + 255 ms * control byte */
+	KUNIT_EXPECT_EQ(test, measured_update_interval(drvdata, 2), 755L);
+	KUNIT_EXPECT_EQ(test, measured_update_interval(drvdata, 5), 1520L);
+	/* ... except 0 */
+	KUNIT_EXPECT_EQ(test, measured_update_interval(drvdata, 0), 250L);
+
+	KUNIT_EXPECT_EQ(test, (int)update_interval_to_control_byte(drvdata, 1010, false), 3);
+	KUNIT_EXPECT_EQ(test, (int)update_interval_to_control_byte(drvdata, 1000, false), 3);
+	KUNIT_EXPECT_EQ(test, (int)update_interval_to_control_byte(drvdata, 1000, true), 2);
+	KUNIT_EXPECT_EQ(test, (int)update_interval_to_control_byte(drvdata, 760, false), 2);
+}
+
+/* Not a test: reports how long it takes to parse a status report */
+static void nzxt_smart2_bench_fan_status(struct kunit *test)
+{
+	struct drvdata *drvdata = test_drvdata(test);
+	struct fan_status_report speed, voltage;
+	u64 start, elapsed;
+	int i;
+
+	test_accept_fan_config(test, drvdata);
+	test_speed_report(&speed);
+	test_voltage_report(&voltage);
+
+	start = ktime_get_ns();
+
+	for (i = 0; i < TEST_BENCH_REPORTS / 2; i++) {
+		handle_fan_status_report(drvdata, &speed, sizeof(speed));
+		handle_fan_status_report(drvdata, &voltage, sizeof(voltage));
+	}
+
+	elapsed = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, drvdata->sample_count, (u64)TEST_BENCH_REPORTS / 2);
+	kunit_info(test, "%llu ns per status report\n",
+		   div_u64(elapsed, TEST_BENCH_REPORTS));
+}
+
+static struct kunit_case nzxt_smart2_test_cases[] = {
+	KUNIT_CASE(nzxt_smart2_test_fan_config),
+	KUNIT_CASE(nzxt_smart2_test_fan_status),
+	KUNIT_CASE(nzxt_smart2_test_fan_status_truncated),
+	KUNIT_CASE(nzxt_smart2_test_scale_pwm),
+	KUNIT_CASE(nzxt_smart2_test_interval_nominal),
+	KUNIT_CASE(nzxt_smart2_test_interval_calibrated),
+	KUNIT_CASE(nzxt_smart2_bench_fan_status),
+	{}
+};
+
+static struct kunit_suite nzxt_smart2_test_suite = {
+	.name = "nzxt-smart2",
+	.test_cases = nzxt_smart2_test_cases,
+};
+
+kunit_test_suites(&nzxt_smart2_test_suite);
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Tracepoints for nzxt-smart2 driver.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nzxt_smart2
+
+#ifndef _NZXT_SMART2_TRACE_TYPES_H
+#define _NZXT_SMART2_TRACE_TYPES_H
+
+/*
+ * What raw_event did with an input report. Defined here (and not in the
+ * driver) because TRACE_DEFINE_ENUM needs the values.
+ */
+enum nzxt_smart2_raw_event_status {
+	NZXT_SMART2_RAW_EVENT_ACCEPTED,
+	/* Unknown report id or status report type */
+	NZXT_SMART2_RAW_EVENT_IGNORED,
+	/* Report is shorter than expected */
+	NZXT_SMART2_RAW_EVENT_BAD_SIZE,
+	/* Fan config report has unexpected magic value */
+	NZXT_SMART2_RAW_EVENT_BAD_MAGIC,
+	/* Status report before fan config report */
+	NZXT_SMART2_RAW_EVENT_NOT_READY,
+};
+
+#endif /* _NZXT_SMART2_TRACE_TYPES_H */
+
+#if !defined(_NZXT_SMART2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NZXT_SMART2_TRACE_H
+
+#include <linux/hid.h>
+#include <linux/hwmon.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/* The second argument of __assign_str() was removed in 6.10 */
+#if KERNEL_VERSION(6, 10, 0) > LINUX_VERSION_CODE
+#define nzxt_smart2_assign_str(dst, src) __assign_str(dst, src)
+#else
+#define nzxt_smart2_assign_str(dst, src) __assign_str(dst)
+#endif
+
+TRACE_DEFINE_ENUM(NZXT_SMART2_RAW_EVENT_ACCEPTED);
+TRACE_DEFINE_ENUM(NZXT_SMART2_RAW_EVENT_IGNORED);
+TRACE_DEFINE_ENUM(NZXT_SMART2_RAW_EVENT_BAD_SIZE);
+TRACE_DEFINE_ENUM(NZXT_SMART2_RAW_EVENT_BAD_MAGIC);
+TRACE_DEFINE_ENUM(NZXT_SMART2_RAW_EVENT_NOT_READY);
+
+#define show_raw_event_status(status)					\
+	__print_symbolic(status,					\
+		{ NZXT_SMART2_RAW_EVENT_ACCEPTED, "accepted" },		\
+		{ NZXT_SMART2_RAW_EVENT_IGNORED, "ignored" },		\
+		{ NZXT_SMART2_RAW_EVENT_BAD_SIZE, "bad_size" },		\
+		{ NZXT_SMART2_RAW_EVENT_BAD_MAGIC, "bad_magic" },	\
+		{ NZXT_SMART2_RAW_EVENT_NOT_READY, "not_ready" })
+
+TRACE_DEFINE_ENUM(hwmon_fan);
+TRACE_DEFINE_ENUM(hwmon_in);
+TRACE_DEFINE_ENUM(hwmon_curr);
+TRACE_DEFINE_ENUM(hwmon_pwm);
+TRACE_DEFINE_ENUM(hwmon_power);
+TRACE_DEFINE_ENUM(hwmon_energy);
+
+#define show_hwmon_type(type)						\
+	__print_symbolic(type,						\
+			 { hwmon_fan, "fan" },				\
+			 { hwmon_in, "in" },				\
+			 { hwmon_curr, "curr" },			\
+			 { hwmon_pwm, "pwm" },				\
+			 { hwmon_power, "power" },			\
+			 { hwmon_energy, "energy" })
+
+TRACE_EVENT(nzxt_smart2_raw_event,
+	TP_PROTO(struct hid_device *hdev, const u8 *data, int size,
+		 enum nzxt_smart2_raw_event_status status),
+
+	TP_ARGS(hdev, data, size, status),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&hdev->dev))
+		__field(u8, report_id)
+		__field(u8, type)
+		__field(int, size)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		nzxt_smart2_assign_str(dev, dev_name(&hdev->dev));
+		__entry->report_id = data[0];
+		/* Status report type, or fan config report magic */
+		__entry->type = size > 1 ? data[1] : 0;
+		__entry->size = size;
+		__entry->status = status;
+	),
+
+	TP_printk("%s: report_id=0x%02x type=0x%02x size=%d %s",
+		  __get_str(dev), __entry->report_id, __entry->type,
+		  __entry->size, show_raw_event_status(__entry->status))
+);
+
+TRACE_EVENT(nzxt_smart2_output_report,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, u8 mask,
+		 u64 duration_ns, int error),
+
+	TP_ARGS(hdev, report_id, mask, duration_ns, error),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&hdev->dev))
+		__field(u8, report_id)
+		__field(u8, mask)
+		__field(u64, duration_ns)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		nzxt_smart2_assign_str(dev, dev_name(&hdev->dev));
+		__entry->report_id = report_id;
+		__entry->mask = mask;
+		__entry->duration_ns = duration_ns;
+		__entry->error = error;
+	),
+
+	TP_printk("%s: report_id=0x%02x mask=0x%02x duration=%lluns error=%d",
+		  __get_str(dev), __entry->report_id, __entry->mask,
+		  __entry->duration_ns, __entry->error)
+);
+
+DECLARE_EVENT_CLASS(nzxt_smart2_read_wait,
+	TP_PROTO(struct device *dev, enum hwmon_sensor_types type, u32 attr,
+		 int channel, int error),
+
+	TP_ARGS(dev, type, attr, channel, error),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(int, type)
+		__field(u32, attr)
+		__field(int, channel)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		nzxt_smart2_assign_str(dev, dev_name(dev));
+		__entry->type = type;
+		__entry->attr = attr;
+		__entry->channel = channel;
+		__entry->error = error;
+	),
+
+	TP_printk("%s: %s channel=%d attr=%u error=%d", __get_str(dev),
+		  show_hwmon_type(__entry->type), __entry->channel,
+		  __entry->attr, __entry->error)
+);
+
+DEFINE_EVENT(nzxt_smart2_read_wait, nzxt_smart2_read_wait_begin,
+	TP_PROTO(struct device *dev, enum hwmon_sensor_types type, u32 attr,
+		 int channel, int error),
+	TP_ARGS(dev, type, attr, channel, error)
+);
+
+DEFINE_EVENT(nzxt_smart2_read_wait, nzxt_smart2_read_wait_end,
+	TP_PROTO(struct device *dev, enum hwmon_sensor_types type, u32 attr,
+		 int channel, int error),
+	TP_ARGS(dev, type, attr, channel, error)
+);
+
+#endif /* _NZXT_SMART2_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nzxt-smart2-trace
+#include <trace/define_trace.h>
@@ -7,21 +7,44 @@
 
 #include <linux/version.h>
 
+#include <linux/btf.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/error-injection.h>
 #include <linux/hid.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/kobject.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #if KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE
 #include <linux/kernel.h>
 #else
 #include <linux/math.h>
 #endif
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/thermal.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <asm/byteorder.h>
 #include <asm/unaligned.h>
 
+#define CREATE_TRACE_POINTS
+#include "nzxt-smart2-trace.h"
+
 /*
  * The device has only 3 fan channels/connectors. But all HID reports have
  * space reserved for up to 8 channels.
@@ -31,6 +54,118 @@
 
 #define UPDATE_INTERVAL_DEFAULT_MS 1000
 
+/*
+ * Minimum interval between automatic fan detection runs (triggered by speed
+ * reports for channels without a detected fan).
+ */
+#define AUTO_DETECT_INTERVAL_MS 30000
+
+/*
+ * pwm ramps (pwm*_ramp_rate): the duty cycle is moved towards the target
+ * every RAMP_PERIOD_MS. Ramp position is kept in 1/RAMP_SCALE percent, so
+ * slow ramps aren't stalled by rounding.
+ */
+#define RAMP_PERIOD_MS 100
+#define RAMP_SCALE 1000
+/* The whole range in one period: anything faster is the same */
+#define RAMP_RATE_MAX (255 * MSEC_PER_SEC / RAMP_PERIOD_MS)
+
+/* Fan groups (pwm*_group), including the terminating null */
+#define FAN_GROUP_NAME_LEN 16
+
+/* Driver attribute callbacks get a const pointer since 6.11 */
+#if KERNEL_VERSION(6, 11, 0) > LINUX_VERSION_CODE
+#define nzxt_smart2_driver_const
+#else
+#define nzxt_smart2_driver_const const
+#endif
+
+/*
+ * BPF hooks are global functions without declarations. These macros (from
+ * linux/btf.h, since 6.7) silence -Wmissing-prototypes for them. Older kernels
+ * don't enable the warning by default.
+ */
+#ifndef __bpf_hook_start
+#define __bpf_hook_start()
+#define __bpf_hook_end()
+#endif
+
+/*
+ * Adaptive update interval: reads are grouped into bursts (all reads within
+ * ADAPTIVE_READ_BURST_MS after the first one, like sensors(1) reading every
+ * attribute). Once per ADAPTIVE_HOLD_SAMPLES samples (or immediately, if
+ * readings start changing fast), the average time between bursts is measured,
+ * and the longest interval that delivers a new sample to every burst is
+ * picked. Up to 1/ADAPTIVE_READ_SLACK of the reader's period is tolerated, so
+ * jitter doesn't make the interval flip. Without readers, the interval is
+ * doubled.
+ */
+#define ADAPTIVE_HOLD_SAMPLES 8
+#define ADAPTIVE_READ_BURST_MS 100
+#define ADAPTIVE_READ_SLACK 16
+
+/*
+ * Readings are changing fast if they change by at least 1/8 between two
+ * samples, and at least by these absolute amounts.
+ */
+#define ADAPTIVE_RPM_DELTA_MIN 100
+#define ADAPTIVE_CURR_DELTA_MIN 50
+
+static unsigned int pwm_coalesce_ms;
+module_param(pwm_coalesce_ms, uint, 0644);
+MODULE_PARM_DESC(pwm_coalesce_ms,
+		 "Merge pwm writes arriving within this interval (in milliseconds) into one output report, 0 to disable (default)");
+
+static bool adaptive_update_interval;
+module_param(adaptive_update_interval, bool, 0644);
+MODULE_PARM_DESC(adaptive_update_interval,
+		 "Initial value of update_interval_auto for new devices (default false)");
+
+static unsigned int adaptive_interval_min_ms = 250;
+module_param(adaptive_interval_min_ms, uint, 0644);
+MODULE_PARM_DESC(adaptive_interval_min_ms,
+		 "Minimum update interval in adaptive mode (in milliseconds, default 250)");
+
+static unsigned int adaptive_interval_max_ms = 8000;
+module_param(adaptive_interval_max_ms, uint, 0644);
+MODULE_PARM_DESC(adaptive_interval_max_ms,
+		 "Maximum update interval in adaptive mode (in milliseconds, default 8000)");
+
+static bool boot_timing;
+module_param(boot_timing, bool, 0644);
+MODULE_PARM_DESC(boot_timing,
+		 "Log how long probe, device initialization, and the first complete sample take");
+
+static unsigned int stall_reports = 3;
+module_param(stall_reports, uint, 0644);
+MODULE_PARM_DESC(stall_reports,
+		 "Number of consecutive speed reports with 0 rpm (and non-zero duty cycle) that trigger fan*_alarm (0 - disabled, default 3)");
+
+static unsigned int cooling_states = 10;
+module_param(cooling_states, uint, 0444);
+MODULE_PARM_DESC(cooling_states,
+		 "Number of thermal cooling device states (above 0) per fan (default 10), 0 to not register cooling devices");
+
+static unsigned int history_size = 4096;
+module_param(history_size, uint, 0444);
+MODULE_PARM_DESC(history_size,
+		 "Number of status reports kept in the history ring buffer (rounded up to a power of 2, default 4096), 0 to disable");
+
+static bool history_overwrite = true;
+module_param(history_overwrite, bool, 0644);
+MODULE_PARM_DESC(history_overwrite,
+		 "Overwrite the oldest entries of a full history ring buffer (default), instead of dropping new reports");
+
+static bool pwm_async;
+module_param(pwm_async, bool, 0644);
+MODULE_PARM_DESC(pwm_async,
+		 "Don't wait for pwm writes to be sent to the device, report errors on the next pwm* access");
+
+static int read_timeout_ms = -1;
+module_param(read_timeout_ms, int, 0644);
+MODULE_PARM_DESC(read_timeout_ms,
+		 "How long fan*_input, in*_input, curr*_input reads wait for the first report (in milliseconds, -1 - forever, 0 - don't wait, fail with ENODATA)");
+
 /* These strings match labels on the device exactly */
 static const char *const fan_label[] = {
 	"FAN 1",
@@ -50,6 +185,18 @@ static const char *const in_label[] = {
 	"FAN 3 Voltage",
 };
 
+static const char *const power_label[] = {
+	"FAN 1 Power",
+	"FAN 2 Power",
+	"FAN 3 Power",
+};
+
+static const char *const energy_label[] = {
+	"FAN 1 Energy",
+	"FAN 2 Energy",
+	"FAN 3 Energy",
+};
+
 enum {
 	INPUT_REPORT_ID_FAN_CONFIG = 0x61,
 	INPUT_REPORT_ID_FAN_STATUS = 0x67,
@@ -60,6 +207,142 @@ enum {
 	FAN_STATUS_REPORT_VOLTAGE = 0x04,
 };
 
+/* Bits in drvdata->notify_pending */
+enum {
+	NOTIFY_SPEED,
+	NOTIFY_VOLTAGE,
+	NOTIFY_SAMPLE,
+	NOTIFY_STALE,
+	NOTIFY_ALARM,
+};
+
+/* pwm*_enable values for channels with a fan connected */
+enum {
+	PWM_ENABLE_MANUAL = 1,
+	/* Fan curve: duty cycle is computed from a thermal zone temperature */
+	PWM_ENABLE_CURVE = 2,
+	/* Closed loop: duty cycle is adjusted to keep fan*_target speed */
+	PWM_ENABLE_TARGET_RPM = 3,
+	/* Duty cycle is returned by nzxt_smart2_fan_policy() */
+	PWM_ENABLE_POLICY = 4,
+};
+
+/*
+ * Argument of nzxt_smart2_fan_policy(): decoded values for one channel. Speed
+ * and duty cycle are from the report that is being handled, voltage and
+ * current - from the last voltage report.
+ */
+struct nzxt_smart2_policy_ctx {
+	u8 channel;
+	u8 fan_type;
+	u8 duty_percent;
+	u16 rpm;
+	u16 in_mv;
+	u16 curr_ma;
+};
+
+/*
+ * Closed-loop fan speed control (PWM_ENABLE_TARGET_RPM) uses a PID controller.
+ * Its state and gains are fixed-point numbers, in 1/(1 << PID_SHIFT) of duty
+ * cycle percent (per RPM of error for the gains). PID_KI is per second, and
+ * PID_KD is per RPM/s, so both are scaled by the time between updates.
+ */
+#define PID_SHIFT 10
+#define PID_KP 24
+#define PID_KI 6
+#define PID_KD 12
+#define PID_OUTPUT_MAX (100 << PID_SHIFT)
+
+/*
+ * Time between updates is clamped to this (for the first update, and after
+ * suspend), so a long gap doesn't make the integral jump.
+ */
+#define PID_DT_MAX_MS 10000
+
+/*
+ * Don't change the duty cycle more often than this: the fan needs some time to
+ * react, and every change is an USB transfer.
+ */
+#define PID_UPDATE_INTERVAL_MIN_MS 500
+
+#define FAN_TARGET_RPM_MAX 10000
+
+struct fan_pid {
+	/* fan*_target */
+	long target_rpm;
+	long integral;
+	long prev_rpm;
+	unsigned long last_update;
+	bool running;
+};
+
+/* Number of points in a fan curve (pwm*_auto_point*_{temp,pwm}) */
+#define CURVE_POINTS 5
+
+/*
+ * Range of curve point temperatures (millidegrees Celsius). Temperatures read
+ * from the thermal zone are clamped to it too, so the interpolation can't
+ * overflow.
+ */
+#define CURVE_TEMP_MIN -55000
+#define CURVE_TEMP_MAX 150000
+
+/*
+ * Piecewise-linear fan curve. Below the first point, the duty cycle is
+ * pwm[0]; above the last point, it is pwm[CURVE_POINTS - 1].
+ */
+struct fan_curve {
+	/* Type of the thermal zone to read the temperature from */
+	char temp_source[THERMAL_NAME_LENGTH];
+	/* In millidegrees Celsius */
+	int temp[CURVE_POINTS];
+	/* 0-255, like pwm* */
+	u8 pwm[CURVE_POINTS];
+	/*
+	 * The fan is slowed down only after the temperature drops by at least
+	 * temp_hyst (millidegrees Celsius) below last_temp - the temperature
+	 * the current duty cycle was computed for.
+	 */
+	int temp_hyst;
+	int last_temp;
+	bool last_temp_valid;
+};
+
+static const struct fan_curve default_fan_curve = {
+	.temp = { 30000, 40000, 50000, 60000, 70000 },
+	.pwm = { 64, 102, 153, 204, 255 },
+	.temp_hyst = 2000,
+};
+
+struct adaptive_interval {
+	/* Protected by mutex, also read without locks */
+	bool enabled;
+	/*
+	 * The rest is protected by wq.lock. The current measurement started
+	 * at window_start, when drvdata->read_bursts was window_bursts.
+	 */
+	unsigned long window_start;
+	unsigned int window_bursts;
+	unsigned int hold;
+	u16 prev_rpm[FAN_CHANNELS];
+	u16 prev_curr[FAN_CHANNELS];
+	/*
+	 * Interval to be set by interval_work (-1 if none yet). With
+	 * target_floor, the longest one not longer than it.
+	 */
+	long target;
+	bool target_floor;
+};
+
+struct drvdata;
+
+/* Thermal cooling device for one fan channel */
+struct fan_cooling {
+	struct drvdata *drvdata;
+	int channel;
+	struct thermal_cooling_device *cdev;
+};
+
 enum {
 	FAN_TYPE_NONE = 0,
 	FAN_TYPE_DC = 1,
@@ -143,8 +426,217 @@ struct fan_status_report {
 	} __packed;
 } __packed;
 
+/*
+ * Snapshot of the whole device state, returned by a single read() from the
+ * "sample" debugfs file. All fields are in host byte order. The layout of a
+ * given version never changes; new fields will be added at the end, with a
+ * version bump.
+ */
+#define SAMPLE_SNAPSHOT_VERSION 1
+
+/* Bits in sample_snapshot.flags: which parts of the snapshot are valid */
+enum {
+	SAMPLE_SNAPSHOT_FAN_CONFIG = BIT(0),
+	SAMPLE_SNAPSHOT_SPEED = BIT(1),
+	SAMPLE_SNAPSHOT_VOLTAGE = BIT(2),
+	/* Values were received before resume, no new sample since then */
+	SAMPLE_SNAPSHOT_STALE = BIT(3),
+};
+
+struct sample_snapshot_channel {
+	/* fan*_input, in RPM */
+	u16 rpm;
+	/* in*_input, in millivolts */
+	u16 in;
+	/* curr*_input, in milliamperes */
+	u16 curr;
+	/* pwm*, 0-255 */
+	u8 pwm;
+	/* See FAN_TYPE_* enum, pwm*_enable and pwm*_mode are derived from it */
+	u8 fan_type;
+};
+
+struct sample_snapshot {
+	/* SAMPLE_SNAPSHOT_VERSION */
+	u32 version;
+	/* sizeof(struct sample_snapshot) */
+	u32 size;
+	/* See SAMPLE_SNAPSHOT_* enum */
+	u32 flags;
+	/* update_interval, in milliseconds */
+	u32 update_interval;
+	/* sample_count attribute */
+	u64 sample_count;
+	/* CLOCK_MONOTONIC time of the last status report, in nanoseconds */
+	u64 timestamp_ns;
+	struct sample_snapshot_channel channels[FAN_CHANNELS];
+};
+
+/*
+ * History ring buffer, mmap()-ed from the "history" debugfs file: a
+ * history_header in the first page, followed by an array of
+ * history_header.entries history_entry structures at history_header.offset.
+ *
+ * The driver appends an entry for every status report at head, and publishes
+ * it by incrementing head (with release semantics). The consumer reads entries
+ * from tail to head, then stores the new tail (also with release semantics).
+ * head and tail are free-running; the entry index is (head % entries).
+ *
+ * When the ring is full, and HISTORY_OVERWRITE flag is set (history_overwrite
+ * module parameter), the oldest entries are overwritten. Otherwise, new
+ * reports are dropped. Either way, the lost entries are counted in lost.
+ *
+ * In overwrite mode, the consumer can't trust the entries it reads without
+ * checking head again: it starts from max(tail, head - entries), and after
+ * copying an entry at position pos (and a read barrier), drops it if
+ * head - pos >= entries - the driver may have been overwriting it.
+ */
+#define HISTORY_VERSION 2
+#define HISTORY_SIZE_MAX (1U << 20)
+
+struct history_header {
+	/* HISTORY_VERSION */
+	u32 version;
+	/* sizeof(struct history_entry) */
+	u32 entry_size;
+	/* Number of entries, a power of 2 */
+	u32 entries;
+	/* Offset of the first entry from the start of the mapping */
+	u32 offset;
+	/* Written only by the driver */
+	u32 head;
+	u32 lost;
+	/* Written only by the consumer */
+	u32 tail;
+	/* See HISTORY_* flags, written only by the driver */
+	u32 flags;
+};
+
+/* history_header.flags */
+enum {
+	HISTORY_OVERWRITE = BIT(0),
+};
+
+struct history_entry {
+	/* CLOCK_MONOTONIC time of the report, in nanoseconds */
+	u64 timestamp_ns;
+	/* FAN_STATUS_REPORT_SPEED or FAN_STATUS_REPORT_VOLTAGE */
+	u8 type;
+	u8 reserved[3];
+	union {
+		/* When type == FAN_STATUS_REPORT_SPEED */
+		struct {
+			u16 fan_rpm[FAN_CHANNELS];
+			u8 duty_percent[FAN_CHANNELS];
+		} speed;
+		/* When type == FAN_STATUS_REPORT_VOLTAGE */
+		struct {
+			u16 fan_in[FAN_CHANNELS];
+			u16 fan_curr[FAN_CHANNELS];
+		} voltage;
+	};
+};
+
+/*
+ * Inter-report jitter histogram: bucket i counts intervals that differ from
+ * the previous interval of the same report type by less than 2^i ms (the last
+ * bucket counts everything else).
+ */
+#define JITTER_BUCKETS 12
+
+/* Timing of one status report type (FAN_STATUS_REPORT_*) */
+struct report_timing {
+	/* Time of the last report, 0 after update interval changes */
+	ktime_t last;
+	/* Last interval between reports, in microseconds (0 if unknown) */
+	u32 interval_us;
+	/* Moving average of interval_us, scaled by 8 (0 if unknown) */
+	u32 avg_interval_us8;
+	u64 reports;
+	/* Reports that didn't arrive within 1.5 nominal update intervals */
+	u64 missed;
+	u64 jitter[JITTER_BUCKETS];
+};
+
+enum {
+	REPORT_TIMING_SPEED,
+	REPORT_TIMING_VOLTAGE,
+	REPORT_TIMING_TYPES,
+};
+
+/*
+ * Measured update interval for one control byte value. It is used instead of
+ * the nominal one after CALIBRATION_MIN_SAMPLES measurements.
+ */
+#define CALIBRATION_MIN_SAMPLES 8
+
+struct interval_calibration {
+	u64 sum_us;
+	u32 count;
+};
+
+/*
+ * The table above control_byte_to_update_interval() is only an approximation,
+ * and the actual intervals differ between devices. Once there are enough
+ * measurements (see report_timing_update()), they replace it: a control byte
+ * with at least CALIBRATION_MIN_SAMPLES measured intervals maps to their
+ * average, the others (except 0, which is a special case) to a least squares
+ * fit of interval = base + step * control_byte over the measured ones.
+ */
+struct interval_map {
+	bool fit;
+	s64 base_us;
+	s64 step_us;
+};
+
+/* Driver statistics (debugfs "stats" file) */
+enum {
+	STAT_CONFIG_REPORTS,
+	STAT_SPEED_REPORTS,
+	STAT_VOLTAGE_REPORTS,
+	/* Unknown report id or status report type */
+	STAT_IGNORED_REPORTS,
+	STAT_DROPPED_BAD_SIZE,
+	STAT_DROPPED_BAD_MAGIC,
+	STAT_DROPPED_NOT_READY,
+	STAT_OUTPUT_REPORTS,
+	STAT_OUTPUT_ERRORS,
+	STAT_MUTEX_LOCKED,
+	/* mutex was held by someone else when trying to lock it */
+	STAT_MUTEX_CONTENDED,
+	STAT_PWM_WRITES,
+	/* Coalesced pwm writes that didn't change the duty cycle */
+	STAT_PWM_WRITES_UNCHANGED,
+	STAT_PWM_ASYNC_WRITES,
+	/* SET_FAN_SPEED reports sent successfully */
+	STAT_PWM_REPORTS,
+	STAT_COUNT,
+};
+
+/*
+ * log2 histograms, in microseconds: bucket 0 counts durations below 1us,
+ * bucket i - below 2^i us, the last one counts everything else.
+ */
+#define STAT_HIST_BUCKETS 24
+
+enum {
+	/* Time spent waiting for the first report in hwmon reads */
+	STAT_HIST_READ_WAIT,
+	/* Time spent in hid_hw_output_report() */
+	STAT_HIST_OUTPUT,
+	STAT_HIST_COUNT,
+};
+
+struct stats {
+	u64 counters[STAT_COUNT];
+	u64 hist[STAT_HIST_COUNT][STAT_HIST_BUCKETS];
+};
+
 #define OUTPUT_REPORT_SIZE 64
 
+/* Maximum number of fire-and-forget reports waiting to be sent */
+#define OUTPUT_QUEUE_LEN 16
+
 enum {
 	OUTPUT_REPORT_ID_INIT_COMMAND = 0x60,
 	OUTPUT_REPORT_ID_SET_FAN_SPEED = 0x62,
@@ -180,6 +672,18 @@ struct drvdata {
 	struct hid_device *hid;
 	struct device *hwmon;
 
+	/*
+	 * Sample state: *_received flags and fan_* arrays. Written from
+	 * raw_event handlers (and by set_pwm()) with wq.lock held, inside a
+	 * sample_seq write section. Readers don't take wq.lock at all: they
+	 * wait for the *_received flag they need (without the lock once the
+	 * flag is set), then read the values under sample_seq.
+	 *
+	 * This part of the structure is written on every input report, so it
+	 * is kept on its own cacheline, away from mutex and output_buffer.
+	 */
+	seqcount_spinlock_t sample_seq ____cacheline_aligned_in_smp;
+
 	u8 fan_duty_percent[FAN_CHANNELS];
 	u16 fan_rpm[FAN_CHANNELS];
 	bool pwm_status_received;
@@ -188,15 +692,123 @@ struct drvdata {
 	u16 fan_curr[FAN_CHANNELS];
 	bool voltage_status_received;
 
+	/*
+	 * Power (in microwatts), computed from every voltage report, and energy
+	 * (in microjoules) - power integrated over time between voltage
+	 * reports. fan_energy_rem is the remainder (in picojoules, below 1uJ).
+	 * voltage_time is the time of the last voltage report, 0 if the
+	 * integration has to restart (at probe and after fan detection).
+	 */
+	u32 fan_power[FAN_CHANNELS];
+	u64 fan_energy[FAN_CHANNELS];
+	u32 fan_energy_rem[FAN_CHANNELS];
+	ktime_t voltage_time;
+
+	/*
+	 * Alarms, evaluated on every status report. fan_min and curr_max are
+	 * written by hwmon_write (with mutex held), and read without locks.
+	 * *_alarm_changed have bits set for channels whose alarm state changed
+	 * since the last notify_work run. stall_count counts consecutive speed
+	 * reports with 0 rpm on a running fan.
+	 */
+	u16 fan_min[FAN_CHANNELS];
+	u16 curr_max[FAN_CHANNELS];
+	u8 fan_alarm;
+	u8 curr_alarm;
+	u8 fan_alarm_changed;
+	u8 curr_alarm_changed;
+	unsigned int stall_count[FAN_CHANNELS];
+
 	u8 fan_type[FAN_CHANNELS];
 	bool fan_config_received;
 
 	/*
-	 * wq is used to wait for *_received flags to become true.
-	 * All accesses to *_received flags and fan_* arrays are performed with
-	 * wq.lock held.
+	 * Set while fan detection (on probe, resume, or rescan) is running.
+	 * Until its result (fan config report) arrives, status reports are
+	 * dropped, but the values received before are still served to readers
+	 * (marked as stale until a complete sample arrives).
+	 */
+	bool fan_detect_pending;
+	bool sample_stale;
+
+	/*
+	 * Duty cycle last sent to the device for channels in duty_set_mask,
+	 * restored after fan detection.
+	 */
+	u8 duty_set[FAN_CHANNELS];
+	u8 duty_set_mask;
+	/* Start of fan detection, for the debug message after pwm restore */
+	ktime_t detect_time;
+	/* jiffies of the last automatic fan detection */
+	unsigned long auto_detect_time;
+	/*
+	 * Channels that triggered the automatic detection in progress, and
+	 * channels where it found no fan anyway: they don't trigger it again
+	 * until they report 0 rpm (or rescan is written). Protected by wq.lock.
+	 */
+	u8 auto_detect_mask;
+	u8 auto_detect_ignore_mask;
+
+	/*
+	 * Number of complete samples (one FAN_STATUS_REPORT_SPEED and one
+	 * FAN_STATUS_REPORT_VOLTAGE report) received. sample_types has a bit
+	 * set for every report type received since the last increment.
 	 */
+	u64 sample_count;
+	u8 sample_types;
+	/* Time of the last status report */
+	ktime_t sample_time;
+	/*
+	 * Updated by readers without locks: jiffies at the start of the last
+	 * read burst, and the number of bursts.
+	 */
+	unsigned long read_burst_time;
+	unsigned int read_bursts;
+	struct adaptive_interval adaptive;
+
+	/*
+	 * Report cadence statistics. update_control is the control byte that
+	 * was last sent to the device. pair_first is the type of the first
+	 * report of the current sample, last_pair_first - of the previous one.
+	 */
+	struct report_timing timing[REPORT_TIMING_TYPES];
+	u8 update_control;
+	u8 pair_first;
+	u8 last_pair_first;
+	/* Speed/voltage report came without the other half of the sample */
+	u64 unpaired_reports;
+	/* Sample started with a different report type than the previous one */
+	u64 out_of_order_pairs;
+
+	/*
+	 * History ring buffer (see struct history_header), NULL if disabled.
+	 * Written with wq.lock held. history_head is the driver's own copy of
+	 * the head: the mapping is writable, so the shared one can't be
+	 * trusted.
+	 */
+	struct history_header *history;
+	struct history_entry *history_entries;
+	u32 history_size;
+	u32 history_head;
+
+	/* wq is used to wait for *_received flags to become true. */
 	wait_queue_head_t wq;
+
+	/*
+	 * Raw_event handlers can't sleep, so they schedule work items for
+	 * everything else (notify_work, control_work). work_enabled is
+	 * protected by wq.lock, and is set only while hwmon is registered:
+	 * raw_event handlers don't schedule any work when it isn't set.
+	 */
+	bool work_enabled;
+
+	/*
+	 * sysfs_notify() can sleep, so raw_event handlers set NOTIFY_* bits
+	 * in notify_pending and schedule notify_work.
+	 */
+	unsigned long notify_pending;
+	struct work_struct notify_work;
+
 	/*
 	 * mutex is used to:
 	 * 1) Prevent concurrent conflicting changes to update interval and pwm
@@ -207,552 +819,3708 @@ struct drvdata {
 	 * because synchronization is necessary anyway - so why not get rid of
 	 * a kmalloc?).
 	 */
-	struct mutex mutex;
+	struct mutex mutex ____cacheline_aligned_in_smp;
 	long update_interval;
 	u8 output_buffer[OUTPUT_REPORT_SIZE];
-};
 
-static long scale_pwm_value(long val, long orig_max, long new_max)
-{
-	if (val <= 0)
-		return 0;
+	/*
+	 * pwm write coalescing (when pwm_coalesce_ms != 0). Writers add their
+	 * channel to the batch that is being collected (pwm_batch), and
+	 * pwm_work sends the whole batch as a single report after the
+	 * coalescing window expires. Protected by mutex, except
+	 * pwm_batch_done and pwm_batch_error, which are also read by waiters
+	 * (in pwm_batch_wq) without the mutex.
+	 */
+	u8 pwm_pending_mask;
+	u8 pwm_pending_async_mask;
+	u8 pwm_pending_duty[FAN_CHANNELS];
+	unsigned long pwm_batch;
+	unsigned long pwm_batch_done;
+	int pwm_batch_error;
+	wait_queue_head_t pwm_batch_wq;
+	struct delayed_work pwm_work;
 
 	/*
-	 * Positive values should not become zero: 0 completely turns off the
-	 * fan.
+	 * Ordered workqueue for everything that sends output reports in the
+	 * background: pwm_work, ramp_work and output_work.
 	 */
-	return max(1L, DIV_ROUND_CLOSEST(min(val, orig_max) * new_max, orig_max));
-}
+	struct workqueue_struct *output_wq;
 
-static void handle_fan_config_report(struct drvdata *drvdata, void *data, int size)
-{
-	struct fan_config_report *report = data;
-	int i;
+	/*
+	 * Fire-and-forget pwm writes (pwm_async without coalescing) are added
+	 * to output_queue at output_queue_head, with output_queue_lock held.
+	 * flush_output_queue() sends them from output_queue_tail, with mutex
+	 * held - either from output_work, or before sending any other report.
+	 */
+	struct work_struct output_work;
+	spinlock_t output_queue_lock;
+	unsigned int output_queue_head;
+	unsigned int output_queue_tail;
+	struct set_fan_speed_report output_queue[OUTPUT_QUEUE_LEN];
 
-	if (size < sizeof(struct fan_config_report))
-		return;
+	/*
+	 * Errors from fire-and-forget pwm writes. Reported (and cleared) by the
+	 * next read or write of the corresponding pwm* attribute.
+	 */
+	int pwm_error[FAN_CHANNELS];
 
-	if (report->magic != 0x03)
-		return;
+	/*
+	 * pwm ramps, protected by mutex. ramp_rate[] is in pwm units per
+	 * second, 0 if ramps are disabled for the channel. ramp_mask has a bit
+	 * set for every channel with a ramp in progress, ramp_pos[] is its
+	 * current duty cycle (in 1/RAMP_SCALE percent). ramp_time is jiffies
+	 * of the last ramp step.
+	 */
+	unsigned int ramp_rate[FAN_CHANNELS];
+	unsigned int ramp_pos[FAN_CHANNELS];
+	u8 ramp_target[FAN_CHANNELS];
+	u8 ramp_mask;
+	unsigned long ramp_time;
+	struct delayed_work ramp_work;
 
-	spin_lock(&drvdata->wq.lock);
+	/*
+	 * Fan groups. node (in nzxt_smart2_devices) and group[] (group name of
+	 * every channel, empty if none) are protected by
+	 * nzxt_smart2_devices_lock. group_work sends group_req->duty_percent
+	 * to channels in group_mask, while set_group_duty_percent() holds the
+	 * mutex for it.
+	 */
+	struct list_head node;
+	char group[FAN_CHANNELS][FAN_GROUP_NAME_LEN];
+	struct fan_group_request *group_req;
+	u8 group_mask;
+	struct work_struct group_work;
 
-	for (i = 0; i < FAN_CHANNELS; i++)
-		drvdata->fan_type[i] = report->fan_type[i];
+	/*
+	 * Automatic fan control. control_mode[] (pwm*_enable), curve[] and
+	 * pid[] are protected by mutex. control_mask has a bit set for every channel not
+	 * in PWM_ENABLE_MANUAL mode; it is also read by raw_event handlers
+	 * (without locks), to decide if control_work has to run on the speed
+	 * report.
+	 */
+	u8 control_mode[FAN_CHANNELS];
+	u8 control_mask;
+	/*
+	 * Channels in PWM_ENABLE_POLICY mode (also read by raw_event handlers
+	 * without locks), and the duty cycles returned by the policy hook for
+	 * them (policy_duty_mask has a bit set for every valid one). The
+	 * latter are protected by wq.lock and sample_seq.
+	 */
+	u8 policy_mask;
+	u8 policy_duty_mask;
+	u8 policy_duty[FAN_CHANNELS];
+	struct fan_curve curve[FAN_CHANNELS];
+	struct fan_pid pid[FAN_CHANNELS];
+	struct work_struct control_work;
 
-	drvdata->fan_config_received = true;
-	wake_up_all_locked(&drvdata->wq);
-	spin_unlock(&drvdata->wq.lock);
-}
+	/*
+	 * Cooling devices are (un)registered by cooling_work, to follow fan
+	 * detection results.
+	 */
+	struct fan_cooling cooling[FAN_CHANNELS];
+	struct work_struct cooling_work;
 
-static void handle_fan_status_report(struct drvdata *drvdata, void *data, int size)
-{
-	struct fan_status_report *report = data;
-	int i;
+	/* Sets adaptive.target update interval */
+	struct work_struct interval_work;
 
-	if (size < sizeof(struct fan_status_report))
-		return;
+	/* Sends duty_set to the device after fan detection */
+	struct work_struct restore_work;
 
-	spin_lock(&drvdata->wq.lock);
+	/* Runs fan detection when a fan is plugged in */
+	struct work_struct detect_work;
 
 	/*
-	 * The device sends INPUT_REPORT_ID_FAN_CONFIG = 0x61 report in response
-	 * to "detect fans" command. Only accept other data after getting 0x61,
-	 * to make sure that fan detection is complete. In particular, fan
-	 * detection resets pwm values.
+	 * Initializes the device (fan detection, update interval) after probe,
+	 * on output_wq. init_done is set when it is complete.
 	 */
-	if (!drvdata->fan_config_received) {
-		spin_unlock(&drvdata->wq.lock);
-		return;
-	}
+	struct work_struct init_work;
+	bool init_done;
+	/* For boot_timing */
+	ktime_t probe_time;
 
-	for (i = 0; i < FAN_CHANNELS; i++) {
-		if (drvdata->fan_type[i] == report->fan_type[i])
-			continue;
+	/*
+	 * Measured update interval for every control byte value (speed
+	 * reports only), and the fit over them, protected by wq.lock. New
+	 * measurements only clear interval_map_valid, the fit is recomputed
+	 * when it is needed (in process context).
+	 */
+	struct interval_calibration calibration[256];
+	struct interval_map interval_map;
+	bool interval_map_valid;
 
-		/*
-		 * This should not happen (if my expectations about the device
-		 * are correct).
-		 *
-		 * Even if the userspace sends fan detect command through
-		 * hidraw, fan config report should arrive first.
-		 */
-		hid_warn_once(drvdata->hid,
-			      "Fan %d type changed unexpectedly from %d to %d",
-			      i, drvdata->fan_type[i], report->fan_type[i]);
-		drvdata->fan_type[i] = report->fan_type[i];
-	}
+	/*
+	 * Per-CPU statistics. Resetting them just copies the current totals to
+	 * stats_base (protected by stats_lock), which is subtracted when
+	 * showing them.
+	 */
+	struct stats __percpu *stats;
+	struct stats stats_base;
+	spinlock_t stats_lock;
 
-	switch (report->type) {
-	case FAN_STATUS_REPORT_SPEED:
-		for (i = 0; i < FAN_CHANNELS; i++) {
-			drvdata->fan_rpm[i] =
-				get_unaligned_le16(&report->fan_speed.fan_rpm[i]);
-			drvdata->fan_duty_percent[i] =
-				report->fan_speed.duty_percent[i];
-		}
+	struct dentry *debugfs;
+};
 
-		drvdata->pwm_status_received = true;
-		wake_up_all_locked(&drvdata->wq);
-		break;
+static void stat_inc(struct drvdata *drvdata, int counter)
+{
+	this_cpu_inc(drvdata->stats->counters[counter]);
+}
 
-	case FAN_STATUS_REPORT_VOLTAGE:
-		for (i = 0; i < FAN_CHANNELS; i++) {
-			drvdata->fan_in[i] =
-				get_unaligned_le16(&report->fan_voltage.fan_in[i]);
-			drvdata->fan_curr[i] =
-				get_unaligned_le16(&report->fan_voltage.fan_current[i]);
-		}
+static void stat_hist_add(struct drvdata *drvdata, int hist, s64 duration_us)
+{
+	unsigned int bucket = 0;
 
-		drvdata->voltage_status_received = true;
-		wake_up_all_locked(&drvdata->wq);
-		break;
-	}
+	if (duration_us > 0)
+		bucket = min(ilog2(duration_us) + 1, STAT_HIST_BUCKETS - 1);
 
-	spin_unlock(&drvdata->wq.lock);
+	this_cpu_inc(drvdata->stats->hist[hist][bucket]);
 }
 
-static umode_t nzxt_smart2_hwmon_is_visible(const void *data,
+/* Locks drvdata->mutex, counting contention */
+static void lock_drvdata(struct drvdata *drvdata)
+{
+	stat_inc(drvdata, STAT_MUTEX_LOCKED);
+
+	if (mutex_trylock(&drvdata->mutex))
+		return;
+
+	stat_inc(drvdata, STAT_MUTEX_CONTENDED);
+	mutex_lock(&drvdata->mutex);
+}
+
+static int lock_drvdata_interruptible(struct drvdata *drvdata)
+{
+	stat_inc(drvdata, STAT_MUTEX_LOCKED);
+
+	if (mutex_trylock(&drvdata->mutex))
+		return 0;
+
+	stat_inc(drvdata, STAT_MUTEX_CONTENDED);
+	return mutex_lock_interruptible(&drvdata->mutex);
+}
+
+static long scale_pwm_value(long val, long orig_max, long new_max)
+{
+	if (val <= 0)
+		return 0;
+
+	/*
+	 * Positive values should not become zero: 0 completely turns off the
+	 * fan.
+	 */
+	return max(1L, DIV_ROUND_CLOSEST(min(val, orig_max) * new_max, orig_max));
+}
+
+/*
+ * Control byte	| Actual update interval in seconds
+ * 0xff		| 65.5
+ * 0xf7		| 63.46
+ * 0x7f		| 32.74
+ * 0x3f		| 16.36
+ * 0x1f		| 8.17
+ * 0x0f		| 4.07
+ * 0x07		| 2.02
+ * 0x03		| 1.00
+ * 0x02		| 0.744
+ * 0x01		| 0.488
+ * 0x00		| 0.25
+ */
+static long control_byte_to_update_interval(u8 control_byte)
+{
+	if (control_byte == 0)
+		return 250;
+
+	return 488 + (control_byte - 1) * 256;
+}
+
+/* Called with wq.lock held */
+static void interval_map_init(struct drvdata *drvdata, struct interval_map *map)
+{
+	s64 sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, n = 0, det, avg_us;
+	struct interval_calibration *entry;
+	int i;
+
+	map->fit = false;
+
+	for (i = 1; i < ARRAY_SIZE(drvdata->calibration); i++) {
+		entry = &drvdata->calibration[i];
+		if (entry->count < CALIBRATION_MIN_SAMPLES)
+			continue;
+
+		avg_us = div_u64(entry->sum_us, entry->count);
+		n++;
+		sum_x += i;
+		sum_y += avg_us;
+		sum_xx += i * i;
+		sum_xy += i * avg_us;
+	}
+
+	det = n * sum_xx - sum_x * sum_x;
+	if (n < 2 || !det)
+		return;
+
+	map->base_us = div64_s64(sum_y * sum_xx - sum_x * sum_xy, det);
+	map->step_us = div64_s64(n * sum_xy - sum_x * sum_y, det);
+	/* Longer intervals for larger control bytes, or it's just noise */
+	map->fit = map->step_us > 0;
+}
+
+/* Returns the cached fit, recomputed if necessary. Called with wq.lock held. */
+static const struct interval_map *interval_map_get(struct drvdata *drvdata)
+{
+	if (!drvdata->interval_map_valid) {
+		interval_map_init(drvdata, &drvdata->interval_map);
+		drvdata->interval_map_valid = true;
+	}
+
+	return &drvdata->interval_map;
+}
+
+/* Called with wq.lock held */
+static s64 interval_map_us(struct drvdata *drvdata,
+			   const struct interval_map *map, u8 control)
+{
+	const struct interval_calibration *entry = &drvdata->calibration[control];
+
+	if (entry->count >= CALIBRATION_MIN_SAMPLES)
+		return div_u64(entry->sum_us, entry->count);
+
+	if (control && map->fit)
+		return max(map->base_us + map->step_us * control, 1LL);
+
+	return control_byte_to_update_interval(control) * 1000LL;
+}
+
+/*
+ * Control byte for an update interval (in milliseconds): the one with the
+ * closest interval, or, if floor is set, the one with the longest interval
+ * not longer than it (or 0 if there is none). Called with wq.lock held, never
+ * from raw_event: it goes through all control bytes.
+ */
+static u8 update_interval_to_control_byte(struct drvdata *drvdata,
+					  long interval, bool floor)
+{
+	const struct interval_map *map = interval_map_get(drvdata);
+	s64 interval_us, best_us, us;
+	int control, best = 0;
+
+	/* Way beyond the longest interval, but can't overflow */
+	interval_us = clamp_val(interval, 0, INT_MAX) * 1000LL;
+	best_us = interval_map_us(drvdata, map, 0);
+
+	for (control = 1; control <= U8_MAX; control++) {
+		us = interval_map_us(drvdata, map, control);
+
+		if (floor ? us <= interval_us && us > best_us :
+			    abs(us - interval_us) < abs(best_us - interval_us)) {
+			best = control;
+			best_us = us;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Measured update interval of a control byte, in milliseconds. Called with
+ * wq.lock held.
+ */
+static long measured_update_interval(struct drvdata *drvdata, u8 control)
+{
+	return DIV_ROUND_CLOSEST_ULL(interval_map_us(drvdata,
+						     interval_map_get(drvdata),
+						     control), 1000);
+}
+
+static enum nzxt_smart2_raw_event_status
+handle_fan_config_report(struct drvdata *drvdata, void *data, int size)
+{
+	struct fan_config_report *report = data;
+	u8 ignore_mask = 0;
+	int i;
+
+	if (size < sizeof(struct fan_config_report))
+		return NZXT_SMART2_RAW_EVENT_BAD_SIZE;
+
+	if (report->magic != 0x03)
+		return NZXT_SMART2_RAW_EVENT_BAD_MAGIC;
+
+	spin_lock(&drvdata->wq.lock);
+	write_seqcount_begin(&drvdata->sample_seq);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		drvdata->fan_type[i] = report->fan_type[i];
+
+		/* Speed without a fan, e.g. a splitter: detecting again won't help */
+		if ((drvdata->auto_detect_mask & BIT(i)) &&
+		    drvdata->fan_type[i] == FAN_TYPE_NONE)
+			ignore_mask |= BIT(i);
+	}
+
+	drvdata->auto_detect_ignore_mask |= ignore_mask;
+	drvdata->auto_detect_mask = 0;
+	drvdata->fan_config_received = true;
+
+	write_seqcount_end(&drvdata->sample_seq);
+	wake_up_all_locked(&drvdata->wq);
+
+	if (drvdata->work_enabled) {
+		schedule_work(&drvdata->cooling_work);
+
+		/* Fan detection has reset pwm values */
+		if (drvdata->fan_detect_pending)
+			queue_work(drvdata->output_wq, &drvdata->restore_work);
+	}
+
+	drvdata->fan_detect_pending = false;
+
+	spin_unlock(&drvdata->wq.lock);
+
+	if (ignore_mask)
+		hid_info(drvdata->hid,
+			 "No fan detected on channels reporting speed (mask 0x%x), not detecting again until they stop\n",
+			 ignore_mask);
+
+	return NZXT_SMART2_RAW_EVENT_ACCEPTED;
+}
+
+static bool value_changing(u16 prev, u16 cur, u16 delta_min)
+{
+	u16 delta = prev > cur ? prev - cur : cur - prev;
+
+	return delta >= delta_min && delta >= prev / 8;
+}
+
+/* Starts a new reader rate measurement. Called with wq.lock held. */
+static void adaptive_interval_reset(struct drvdata *drvdata)
+{
+	struct adaptive_interval *adaptive = &drvdata->adaptive;
+
+	adaptive->hold = 0;
+	adaptive->window_start = jiffies;
+	adaptive->window_bursts = READ_ONCE(drvdata->read_bursts);
+}
+
+/*
+ * Called for every complete sample, with wq.lock held. Picks a new update
+ * interval, if necessary, and schedules interval_work to find its control byte
+ * and set it.
+ */
+static void adaptive_interval_update(struct drvdata *drvdata)
+{
+	struct adaptive_interval *adaptive = &drvdata->adaptive;
+	long target = READ_ONCE(drvdata->update_interval);
+	unsigned int bursts;
+	bool changing = false;
+	bool floor = false;
+	int i;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		changing |= value_changing(adaptive->prev_rpm[i],
+					   drvdata->fan_rpm[i],
+					   ADAPTIVE_RPM_DELTA_MIN);
+		changing |= value_changing(adaptive->prev_curr[i],
+					   drvdata->fan_curr[i],
+					   ADAPTIVE_CURR_DELTA_MIN);
+
+		adaptive->prev_rpm[i] = drvdata->fan_rpm[i];
+		adaptive->prev_curr[i] = drvdata->fan_curr[i];
+	}
+
+	if (!READ_ONCE(adaptive->enabled))
+		return;
+
+	if (adaptive->hold < ADAPTIVE_HOLD_SAMPLES)
+		adaptive->hold++;
+
+	if (changing) {
+		target = 0;
+	} else if (adaptive->hold >= ADAPTIVE_HOLD_SAMPLES) {
+		bursts = READ_ONCE(drvdata->read_bursts) - adaptive->window_bursts;
+
+		if (bursts) {
+			target = jiffies_to_msecs(jiffies - adaptive->window_start) / bursts;
+			target += target / ADAPTIVE_READ_SLACK;
+			floor = true;
+		} else {
+			target *= 2;
+		}
+
+		adaptive_interval_reset(drvdata);
+	} else {
+		return;
+	}
+
+	target = clamp_val(target, READ_ONCE(adaptive_interval_min_ms),
+			   READ_ONCE(adaptive_interval_max_ms));
+
+	if (target == adaptive->target && floor == adaptive->target_floor)
+		return;
+
+	adaptive_interval_reset(drvdata);
+	adaptive->target = target;
+	adaptive->target_floor = floor;
+
+	if (drvdata->work_enabled)
+		queue_work(drvdata->output_wq, &drvdata->interval_work);
+}
+
+/*
+ * Called for every status report, with wq.lock held, after sample_time is
+ * updated.
+ */
+static void report_timing_update(struct drvdata *drvdata, u8 type)
+{
+	struct interval_calibration *calibration;
+	struct report_timing *timing;
+	long nominal_us;
+	s64 interval_us;
+	u32 jitter_ms;
+
+	timing = &drvdata->timing[type == FAN_STATUS_REPORT_SPEED ?
+				  REPORT_TIMING_SPEED : REPORT_TIMING_VOLTAGE];
+	timing->reports++;
+
+	if (!timing->last) {
+		timing->last = drvdata->sample_time;
+		return;
+	}
+
+	interval_us = ktime_us_delta(drvdata->sample_time, timing->last);
+	timing->last = drvdata->sample_time;
+
+	nominal_us = control_byte_to_update_interval(drvdata->update_control) * 1000;
+	if (interval_us > nominal_us * 3 / 2) {
+		/*
+		 * Don't let lost reports skew the average: the interval is
+		 * a multiple of the real one.
+		 */
+		timing->missed += DIV_ROUND_CLOSEST_ULL(interval_us, nominal_us) - 1;
+		timing->interval_us = 0;
+		return;
+	}
+
+	if (timing->interval_us) {
+		jitter_ms = abs(interval_us - (s64)timing->interval_us) / 1000;
+		timing->jitter[min_t(u32, jitter_ms ? ilog2(jitter_ms) + 1 : 0,
+				     JITTER_BUCKETS - 1)]++;
+	}
+
+	timing->interval_us = interval_us;
+
+	if (timing->avg_interval_us8)
+		timing->avg_interval_us8 += interval_us - timing->avg_interval_us8 / 8;
+	else
+		timing->avg_interval_us8 = interval_us * 8;
+
+	if (type == FAN_STATUS_REPORT_SPEED) {
+		calibration = &drvdata->calibration[drvdata->update_control];
+		calibration->sum_us += interval_us;
+		calibration->count++;
+
+		if (calibration->count >= CALIBRATION_MIN_SAMPLES)
+			drvdata->interval_map_valid = false;
+
+		/* Report the measured interval as soon as it is known */
+		if (calibration->count == CALIBRATION_MIN_SAMPLES)
+			WRITE_ONCE(drvdata->update_interval,
+				   DIV_ROUND_CLOSEST_ULL(calibration->sum_us,
+							 calibration->count * 1000ULL));
+	}
+}
+
+/* Control byte for adaptive.target. Called with wq.lock held. */
+static u8 adaptive_interval_control(struct drvdata *drvdata)
+{
+	struct adaptive_interval *adaptive = &drvdata->adaptive;
+	long target = adaptive->target;
+	u8 control;
+
+	if (adaptive->target_floor) {
+		control = update_interval_to_control_byte(drvdata, target, true);
+		target = measured_update_interval(drvdata, control);
+	}
+
+	target = clamp_val(target, READ_ONCE(adaptive_interval_min_ms),
+			   READ_ONCE(adaptive_interval_max_ms));
+	return update_interval_to_control_byte(drvdata, target, false);
+}
+
+/* Called with wq.lock held, after sending a new update interval */
+static void report_timing_reset(struct drvdata *drvdata, u8 control)
+{
+	int i;
+
+	drvdata->update_control = control;
+
+	for (i = 0; i < REPORT_TIMING_TYPES; i++) {
+		drvdata->timing[i].last = 0;
+		drvdata->timing[i].interval_us = 0;
+		drvdata->timing[i].avg_interval_us8 = 0;
+	}
+}
+
+/*
+ * Appends the current values of the given report type to the history ring
+ * buffer. Must be called with wq.lock held.
+ */
+static void history_append(struct drvdata *drvdata, u8 type)
+{
+	struct history_header *header = drvdata->history;
+	struct history_entry *entry;
+	u32 head = drvdata->history_head;
+	bool overwrite = READ_ONCE(history_overwrite);
+	u32 entries;
+	int i;
+
+	if (!header)
+		return;
+
+	/* The shared header is writable too, use the size from the driver */
+	entries = drvdata->history_size;
+
+	WRITE_ONCE(header->flags, overwrite ? HISTORY_OVERWRITE : 0);
+
+	/* Pairs with the release store of the tail by the consumer */
+	if (head - smp_load_acquire(&header->tail) >= entries) {
+		WRITE_ONCE(header->lost, header->lost + 1);
+		if (!overwrite)
+			return;
+	}
+
+	/*
+	 * The consumer checks head after reading an entry: the store of the
+	 * previous head must be visible before the entry is overwritten.
+	 */
+	if (overwrite)
+		smp_wmb();
+
+	entry = &drvdata->history_entries[head & (entries - 1)];
+	entry->timestamp_ns = ktime_to_ns(drvdata->sample_time);
+	entry->type = type;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (type == FAN_STATUS_REPORT_SPEED) {
+			entry->speed.fan_rpm[i] = drvdata->fan_rpm[i];
+			entry->speed.duty_percent[i] = drvdata->fan_duty_percent[i];
+		} else {
+			entry->voltage.fan_in[i] = drvdata->fan_in[i];
+			entry->voltage.fan_curr[i] = drvdata->fan_curr[i];
+		}
+	}
+
+	drvdata->history_head = head + 1;
+	smp_store_release(&header->head, drvdata->history_head);
+}
+
+/*
+ * Called on every speed report, in a sample_seq write section. A running fan
+ * (detected, with non-zero duty cycle) is in alarm state if it is below
+ * fan_min, or stalled (0 rpm for stall_reports consecutive reports).
+ */
+static void update_fan_alarms(struct drvdata *drvdata)
+{
+	unsigned int stall_limit = READ_ONCE(stall_reports);
+	u8 alarm = 0;
+	bool running;
+	u16 min;
+	int i;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		running = drvdata->fan_type[i] != FAN_TYPE_NONE &&
+			  drvdata->fan_duty_percent[i];
+
+		if (running && !drvdata->fan_rpm[i])
+			drvdata->stall_count[i]++;
+		else
+			drvdata->stall_count[i] = 0;
+
+		if (stall_limit && drvdata->stall_count[i] >= stall_limit)
+			alarm |= BIT(i);
+
+		min = READ_ONCE(drvdata->fan_min[i]);
+		if (running && drvdata->fan_rpm[i] < min)
+			alarm |= BIT(i);
+	}
+
+	if (alarm == drvdata->fan_alarm)
+		return;
+
+	drvdata->fan_alarm_changed |= alarm ^ drvdata->fan_alarm;
+	drvdata->fan_alarm = alarm;
+	set_bit(NOTIFY_ALARM, &drvdata->notify_pending);
+}
+
+/* Called on every voltage report, in a sample_seq write section */
+static void update_curr_alarms(struct drvdata *drvdata)
+{
+	u8 alarm = 0;
+	u16 max;
+	int i;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		max = READ_ONCE(drvdata->curr_max[i]);
+		if (max && drvdata->fan_curr[i] > max)
+			alarm |= BIT(i);
+	}
+
+	if (alarm == drvdata->curr_alarm)
+		return;
+
+	drvdata->curr_alarm_changed |= alarm ^ drvdata->curr_alarm;
+	drvdata->curr_alarm = alarm;
+	set_bit(NOTIFY_ALARM, &drvdata->notify_pending);
+}
+
+/*
+ * Adds the energy used since the previous voltage report (assuming power
+ * didn't change since then) to fan_energy. Must be called in a sample_seq write
+ * section, before fan_power is updated.
+ */
+static void update_energy(struct drvdata *drvdata)
+{
+	ktime_t now = ktime_get();
+	u64 energy_pj;
+	s64 delta_us;
+	u32 rem;
+	int i;
+
+	if (drvdata->voltage_time) {
+		delta_us = ktime_us_delta(now, drvdata->voltage_time);
+
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			/* uW * us = pJ */
+			energy_pj = (u64)drvdata->fan_power[i] * delta_us +
+				    drvdata->fan_energy_rem[i];
+			drvdata->fan_energy[i] += div_u64_rem(energy_pj, 1000000,
+							      &rem);
+			drvdata->fan_energy_rem[i] = rem;
+		}
+	}
+
+	drvdata->voltage_time = now;
+}
+
+/*
+ * Fan policy hook. Called for every channel in PWM_ENABLE_POLICY mode on every
+ * speed report, from raw_event (in atomic context, but without driver locks).
+ * Does nothing by itself: a BPF program attached to it (fmod_ret) returns the
+ * duty cycle for the channel plus one (1-101, so 0% is distinct from 0), or 0
+ * to keep the current one. The function itself is only called if the program
+ * returns 0.
+ *
+ * Any other value, in particular a negative errno (which is what the
+ * ERRNO annotation lets fail_function inject), also keeps the current duty
+ * cycle.
+ */
+#define FAN_POLICY_DUTY_OFFSET 1
+
+__bpf_hook_start();
+
+__visible noinline int
+nzxt_smart2_fan_policy(const struct nzxt_smart2_policy_ctx *ctx)
+{
+	return 0;
+}
+
+__bpf_hook_end();
+
+ALLOW_ERROR_INJECTION(nzxt_smart2_fan_policy, ERRNO);
+
+/*
+ * Fills the policy hook arguments for channels in PWM_ENABLE_POLICY mode,
+ * returns their mask. Must be called with wq.lock held.
+ */
+static u8 fill_policy_ctx(struct drvdata *drvdata,
+			  struct nzxt_smart2_policy_ctx *ctx)
+{
+	u8 policy_mask = READ_ONCE(drvdata->policy_mask);
+	int i;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (!(policy_mask & BIT(i)))
+			continue;
+
+		ctx[i] = (struct nzxt_smart2_policy_ctx) {
+			.channel = i,
+			.fan_type = drvdata->fan_type[i],
+			.duty_percent = drvdata->fan_duty_percent[i],
+			.rpm = drvdata->fan_rpm[i],
+			.in_mv = drvdata->fan_in[i],
+			.curr_ma = drvdata->fan_curr[i],
+		};
+	}
+
+	return policy_mask;
+}
+
+/*
+ * Runs the policy hook for channels in policy_mask, publishes the decisions
+ * and queues control_work to apply them. Must be called without wq.lock: the
+ * BPF program takes as long as it takes, readers shouldn't spin on sample_seq
+ * meanwhile.
+ */
+static void run_fan_policy(struct drvdata *drvdata, u8 policy_mask,
+			   const struct nzxt_smart2_policy_ctx *ctx)
+{
+	u8 duty_percent[FAN_CHANNELS];
+	u8 duty_mask = 0;
+	int i, ret;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (!(policy_mask & BIT(i)))
+			continue;
+
+		ret = nzxt_smart2_fan_policy(&ctx[i]) - FAN_POLICY_DUTY_OFFSET;
+		if (ret < 0 || ret > 100)
+			continue;
+
+		duty_percent[i] = ret;
+		duty_mask |= BIT(i);
+	}
+
+	spin_lock(&drvdata->wq.lock);
+
+	if (duty_mask) {
+		write_seqcount_begin(&drvdata->sample_seq);
+
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			if (duty_mask & BIT(i))
+				drvdata->policy_duty[i] = duty_percent[i];
+		}
+
+		drvdata->policy_duty_mask |= duty_mask;
+		write_seqcount_end(&drvdata->sample_seq);
+	}
+
+	if (drvdata->work_enabled)
+		queue_work(drvdata->output_wq, &drvdata->control_work);
+
+	spin_unlock(&drvdata->wq.lock);
+}
+
+static enum nzxt_smart2_raw_event_status
+handle_fan_status_report(struct drvdata *drvdata, void *data, int size)
+{
+	struct nzxt_smart2_policy_ctx policy_ctx[FAN_CHANNELS];
+	struct fan_status_report *report = data;
+	u8 plugged_mask = 0;
+	u8 policy_mask = 0;
+	int i;
+
+	if (size < sizeof(struct fan_status_report))
+		return NZXT_SMART2_RAW_EVENT_BAD_SIZE;
+
+	spin_lock(&drvdata->wq.lock);
+
+	/*
+	 * The device sends INPUT_REPORT_ID_FAN_CONFIG = 0x61 report in response
+	 * to "detect fans" command. Only accept other data after getting 0x61,
+	 * to make sure that fan detection is complete. In particular, fan
+	 * detection resets pwm values.
+	 */
+	if (!drvdata->fan_config_received || drvdata->fan_detect_pending) {
+		spin_unlock(&drvdata->wq.lock);
+		return NZXT_SMART2_RAW_EVENT_NOT_READY;
+	}
+
+	write_seqcount_begin(&drvdata->sample_seq);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (drvdata->fan_type[i] == report->fan_type[i])
+			continue;
+
+		/*
+		 * This should not happen (if my expectations about the device
+		 * are correct).
+		 *
+		 * Even if the userspace sends fan detect command through
+		 * hidraw, fan config report should arrive first.
+		 */
+		hid_warn_once(drvdata->hid,
+			      "Fan %d type changed unexpectedly from %d to %d",
+			      i, drvdata->fan_type[i], report->fan_type[i]);
+		drvdata->fan_type[i] = report->fan_type[i];
+	}
+
+	switch (report->type) {
+	case FAN_STATUS_REPORT_SPEED:
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			drvdata->fan_rpm[i] =
+				get_unaligned_le16(&report->fan_speed.fan_rpm[i]);
+			drvdata->fan_duty_percent[i] =
+				report->fan_speed.duty_percent[i];
+
+			if (!drvdata->fan_rpm[i])
+				drvdata->auto_detect_ignore_mask &= ~BIT(i);
+			else if (drvdata->fan_type[i] == FAN_TYPE_NONE)
+				plugged_mask |= BIT(i);
+		}
+
+		plugged_mask &= ~drvdata->auto_detect_ignore_mask;
+
+		update_fan_alarms(drvdata);
+
+		/* The hook itself runs after the lock is released */
+		if (READ_ONCE(drvdata->policy_mask))
+			policy_mask = fill_policy_ctx(drvdata, policy_ctx);
+
+		drvdata->pwm_status_received = true;
+		set_bit(NOTIFY_SPEED, &drvdata->notify_pending);
+		break;
+
+	case FAN_STATUS_REPORT_VOLTAGE:
+		update_energy(drvdata);
+
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			drvdata->fan_in[i] =
+				get_unaligned_le16(&report->fan_voltage.fan_in[i]);
+			drvdata->fan_curr[i] =
+				get_unaligned_le16(&report->fan_voltage.fan_current[i]);
+			/* mV * mA = uW */
+			drvdata->fan_power[i] = (u32)drvdata->fan_in[i] *
+						drvdata->fan_curr[i];
+		}
+
+		update_curr_alarms(drvdata);
+
+		drvdata->voltage_status_received = true;
+		set_bit(NOTIFY_VOLTAGE, &drvdata->notify_pending);
+		break;
+
+	default:
+		write_seqcount_end(&drvdata->sample_seq);
+		spin_unlock(&drvdata->wq.lock);
+		return NZXT_SMART2_RAW_EVENT_IGNORED;
+	}
+
+	drvdata->sample_time = ktime_get();
+	history_append(drvdata, report->type);
+	report_timing_update(drvdata, report->type);
+
+	if (drvdata->sample_types & report->type) {
+		/* The other half of the previous sample never arrived */
+		drvdata->unpaired_reports++;
+		drvdata->sample_types = 0;
+	}
+
+	if (!drvdata->sample_types)
+		drvdata->pair_first = report->type;
+
+	drvdata->sample_types |= report->type;
+	if (drvdata->sample_types ==
+	    (FAN_STATUS_REPORT_SPEED | FAN_STATUS_REPORT_VOLTAGE)) {
+		if (drvdata->last_pair_first &&
+		    drvdata->last_pair_first != drvdata->pair_first)
+			drvdata->out_of_order_pairs++;
+
+		drvdata->last_pair_first = drvdata->pair_first;
+		if (drvdata->sample_stale) {
+			drvdata->sample_stale = false;
+			set_bit(NOTIFY_STALE, &drvdata->notify_pending);
+		}
+		drvdata->sample_types = 0;
+		drvdata->sample_count++;
+
+		if (drvdata->sample_count == 1 && READ_ONCE(boot_timing))
+			hid_info(drvdata->hid, "first sample received %lld us after probe\n",
+				 ktime_us_delta(drvdata->sample_time,
+						drvdata->probe_time));
+
+		set_bit(NOTIFY_SAMPLE, &drvdata->notify_pending);
+		adaptive_interval_update(drvdata);
+	}
+
+	write_seqcount_end(&drvdata->sample_seq);
+	wake_up_all_locked(&drvdata->wq);
+
+	if (drvdata->work_enabled) {
+		schedule_work(&drvdata->notify_work);
+
+		/*
+		 * Automatic control runs at the device's report rate (queued by
+		 * run_fan_policy() with a policy, so it sees the decisions).
+		 */
+		if (report->type == FAN_STATUS_REPORT_SPEED && !policy_mask &&
+		    READ_ONCE(drvdata->control_mask))
+			queue_work(drvdata->output_wq, &drvdata->control_work);
+
+		/* A fan was plugged in: new fans can't be controlled otherwise */
+		if (plugged_mask &&
+		    time_after(jiffies, drvdata->auto_detect_time +
+			       msecs_to_jiffies(AUTO_DETECT_INTERVAL_MS))) {
+			drvdata->auto_detect_time = jiffies;
+			drvdata->auto_detect_mask = plugged_mask;
+			queue_work(drvdata->output_wq, &drvdata->detect_work);
+		}
+	}
+
+	spin_unlock(&drvdata->wq.lock);
+
+	if (policy_mask)
+		run_fan_policy(drvdata, policy_mask, policy_ctx);
+
+	return NZXT_SMART2_RAW_EVENT_ACCEPTED;
+}
+
+/*
+ * Wakes up poll() waiters on an attribute that has a new value. Unlike
+ * hwmon_notify_event(), doesn't send a uevent: new values arrive every update
+ * interval, and every uevent wakes up udev.
+ */
+static void notify_value(struct drvdata *drvdata, const char *fmt, int index)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), fmt, index);
+	sysfs_notify(&drvdata->hwmon->kobj, NULL, name);
+}
+
+/*
+ * Notifies pollers of the alarm attribute, and sends a uevent with the
+ * attribute name and the new state. Not hwmon_notify_event(): it sends its own
+ * uevent, without the state.
+ */
+static void notify_alarm(struct drvdata *drvdata, const char *name,
+			 int channel, bool alarm)
+{
+	char attr[16], attr_env[32], state_env[32];
+	char *envp[] = { attr_env, state_env, NULL };
+
+	snprintf(attr, sizeof(attr), "%s%d_alarm", name, channel + 1);
+	sysfs_notify(&drvdata->hwmon->kobj, NULL, attr);
+
+	snprintf(attr_env, sizeof(attr_env), "ALARM=%s", attr);
+	snprintf(state_env, sizeof(state_env), "STATE=%d", alarm);
+	kobject_uevent_env(&drvdata->hwmon->kobj, KOBJ_CHANGE, envp);
+}
+
+static void notify_alarms(struct drvdata *drvdata)
+{
+	u8 fan_changed, curr_changed, fan_alarm, curr_alarm;
+	int i;
+
+	spin_lock_bh(&drvdata->wq.lock);
+	fan_changed = drvdata->fan_alarm_changed;
+	curr_changed = drvdata->curr_alarm_changed;
+	fan_alarm = drvdata->fan_alarm;
+	curr_alarm = drvdata->curr_alarm;
+	drvdata->fan_alarm_changed = 0;
+	drvdata->curr_alarm_changed = 0;
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (fan_changed & BIT(i))
+			notify_alarm(drvdata, "fan", i, fan_alarm & BIT(i));
+
+		if (curr_changed & BIT(i))
+			notify_alarm(drvdata, "curr", i, curr_alarm & BIT(i));
+	}
+}
+
+static void notify_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, notify_work);
+	int i;
+
+	if (test_and_clear_bit(NOTIFY_SPEED, &drvdata->notify_pending)) {
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			notify_value(drvdata, "fan%d_input", i + 1);
+			notify_value(drvdata, "pwm%d", i + 1);
+		}
+	}
+
+	if (test_and_clear_bit(NOTIFY_VOLTAGE, &drvdata->notify_pending)) {
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			notify_value(drvdata, "in%d_input", i);
+			notify_value(drvdata, "curr%d_input", i + 1);
+			notify_value(drvdata, "power%d_input", i + 1);
+			notify_value(drvdata, "energy%d_input", i + 1);
+		}
+	}
+
+	if (test_and_clear_bit(NOTIFY_SAMPLE, &drvdata->notify_pending))
+		sysfs_notify(&drvdata->hwmon->kobj, NULL, "sample_count");
+
+	if (test_and_clear_bit(NOTIFY_STALE, &drvdata->notify_pending))
+		sysfs_notify(&drvdata->hwmon->kobj, NULL, "sample_stale");
+
+	if (test_and_clear_bit(NOTIFY_ALARM, &drvdata->notify_pending))
+		notify_alarms(drvdata);
+}
+
+static void set_work_enabled(struct drvdata *drvdata, bool enabled)
+{
+	spin_lock_bh(&drvdata->wq.lock);
+	drvdata->work_enabled = enabled;
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	if (enabled) {
+		/* Fan config could arrive before the work was enabled */
+		schedule_work(&drvdata->cooling_work);
+	} else {
+		cancel_work_sync(&drvdata->notify_work);
+		cancel_work_sync(&drvdata->control_work);
+		cancel_work_sync(&drvdata->cooling_work);
+		cancel_work_sync(&drvdata->interval_work);
+		cancel_work_sync(&drvdata->restore_work);
+		cancel_work_sync(&drvdata->detect_work);
+	}
+}
+
+/*
+ * Lets adaptive update interval measure how often readings are read. Only the
+ * first read of every burst writes anything, so the cacheline isn't dirtied on
+ * every read. Concurrent readers may lose an increment, which only makes the
+ * measured rate slightly lower.
+ */
+static void mark_sample_consumed(struct drvdata *drvdata)
+{
+	unsigned long now = jiffies;
+
+	if (time_before(now, READ_ONCE(drvdata->read_burst_time) +
+			     msecs_to_jiffies(ADAPTIVE_READ_BURST_MS)))
+		return;
+
+	WRITE_ONCE(drvdata->read_burst_time, now);
+	WRITE_ONCE(drvdata->read_bursts, READ_ONCE(drvdata->read_bursts) + 1);
+}
+
+static umode_t nzxt_smart2_hwmon_is_visible(const void *data,
 					    enum hwmon_sensor_types type,
 					    u32 attr, int channel)
 {
-	switch (type) {
-	case hwmon_pwm:
-		switch (attr) {
-		case hwmon_pwm_input:
-		case hwmon_pwm_enable:
-			return 0644;
+	switch (type) {
+	case hwmon_fan:
+		switch (attr) {
+		case hwmon_fan_target:
+		case hwmon_fan_min:
+			return 0644;
+
+		default:
+			return 0444;
+		}
+
+	case hwmon_curr:
+		switch (attr) {
+		case hwmon_curr_max:
+			return 0644;
+
+		default:
+			return 0444;
+		}
+
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_input:
+		case hwmon_pwm_enable:
+			return 0644;
+
+		default:
+			return 0444;
+		}
+
+	case hwmon_chip:
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			return 0644;
+
+		default:
+			return 0444;
+		}
+
+	default:
+		return 0444;
+	}
+}
+
+/*
+ * Returns the *_received flag that must be set before the value of the given
+ * attribute can be read, or NULL if the attribute isn't readable.
+ */
+static const bool *sample_received_flag(struct drvdata *drvdata,
+					enum hwmon_sensor_types type, u32 attr)
+{
+	switch (type) {
+	case hwmon_pwm:
+		/*
+		 * fancontrol:
+		 * 1) remembers pwm* values when it starts
+		 * 2) needs pwm*_enable to be 1 on controlled fans
+		 * So make sure we have correct data before allowing pwm* reads.
+		 * Returning errors for pwm of fan speed read can even cause
+		 * fancontrol to shut down. So the wait is unavoidable.
+		 */
+		switch (attr) {
+		case hwmon_pwm_enable:
+		case hwmon_pwm_mode:
+			return &drvdata->fan_config_received;
+
+		case hwmon_pwm_input:
+			return &drvdata->pwm_status_received;
+
+		default:
+			return NULL;
+		}
+
+	/*
+	 * It's not strictly necessary to wait for *_received in the remaining
+	 * cases (fancontrol doesn't care about them). But I'm doing it to have
+	 * consistent behavior.
+	 */
+	case hwmon_fan:
+		switch (attr) {
+		case hwmon_fan_input:
+		case hwmon_fan_alarm:
+			return &drvdata->pwm_status_received;
+
+		default:
+			return NULL;
+		}
+
+	case hwmon_in:
+		return attr == hwmon_in_input ? &drvdata->voltage_status_received : NULL;
+
+	case hwmon_curr:
+		switch (attr) {
+		case hwmon_curr_input:
+		case hwmon_curr_alarm:
+			return &drvdata->voltage_status_received;
+
+		default:
+			return NULL;
+		}
+
+	case hwmon_power:
+		return attr == hwmon_power_input ? &drvdata->voltage_status_received : NULL;
+
+	case hwmon_energy:
+		return attr == hwmon_energy_input ? &drvdata->voltage_status_received : NULL;
+
+	default:
+		return NULL;
+	}
+}
+
+/* Must be called inside a sample_seq read section. */
+static long sample_value(const struct drvdata *drvdata,
+			 enum hwmon_sensor_types type, u32 attr, int channel)
+{
+	switch (type) {
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_enable:
+			if (drvdata->fan_type[channel] == FAN_TYPE_NONE)
+				return 0;
+
+			return READ_ONCE(drvdata->control_mode[channel]);
+
+		case hwmon_pwm_mode:
+			return drvdata->fan_type[channel] == FAN_TYPE_PWM;
+
+		default:
+			return scale_pwm_value(drvdata->fan_duty_percent[channel],
+					       100, 255);
+		}
+
+	case hwmon_fan:
+		if (attr == hwmon_fan_alarm)
+			return !!(drvdata->fan_alarm & BIT(channel));
+
+		return drvdata->fan_rpm[channel];
+
+	case hwmon_in:
+		return drvdata->fan_in[channel];
+
+	case hwmon_curr:
+		if (attr == hwmon_curr_alarm)
+			return !!(drvdata->curr_alarm & BIT(channel));
+
+		return drvdata->fan_curr[channel];
+
+	case hwmon_power:
+		return drvdata->fan_power[channel];
+
+	case hwmon_energy:
+		return min_t(u64, drvdata->fan_energy[channel], LONG_MAX);
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Waits for *received to become true. Once it is true, the wait doesn't touch
+ * wq.lock. smp_load_acquire() orders the flag read before the sample_seq read
+ * that follows: the flag is set inside a sample_seq write section.
+ */
+static int wait_sample_received(struct drvdata *drvdata, const bool *received)
+{
+	return wait_event_interruptible(drvdata->wq, smp_load_acquire(received));
+}
+
+/*
+ * Like wait_sample_received(), but gives up after timeout_ms (if it isn't
+ * negative) with -ENODATA.
+ */
+static int wait_sample_received_timeout(struct drvdata *drvdata,
+					const bool *received, int timeout_ms)
+{
+	long ret;
+
+	if (timeout_ms < 0)
+		return wait_sample_received(drvdata, received);
+
+	if (smp_load_acquire(received))
+		return 0;
+
+	if (!timeout_ms)
+		return -ENODATA;
+
+	ret = wait_event_interruptible_timeout(drvdata->wq,
+					       smp_load_acquire(received),
+					       msecs_to_jiffies(timeout_ms));
+	if (ret < 0)
+		return ret;
+
+	return ret ? 0 : -ENODATA;
+}
+
+/*
+ * Returns (and clears) the error from a previous fire-and-forget pwm write to
+ * the channel, if any.
+ */
+static int take_pwm_error(struct drvdata *drvdata, int channel)
+{
+	/* Don't dirty the cacheline when there is no error */
+	if (likely(!READ_ONCE(drvdata->pwm_error[channel])))
+		return 0;
+
+	return xchg(&drvdata->pwm_error[channel], 0);
+}
+
+static void set_pwm_error(struct drvdata *drvdata, u8 channel_mask, int error)
+{
+	int i;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (channel_mask & BIT(i))
+			WRITE_ONCE(drvdata->pwm_error[i], error);
+	}
+
+	dev_warn_ratelimited(&drvdata->hid->dev,
+			     "Failed to set fan speed (channel mask 0x%x): %d\n",
+			     channel_mask, error);
+}
+
+static int nzxt_smart2_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+				  u32 attr, int channel, long *val)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	const bool *received;
+	unsigned int seq;
+	ktime_t start;
+	int res;
+
+	if (type == hwmon_chip) {
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			*val = READ_ONCE(drvdata->update_interval);
+			return 0;
+
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (type == hwmon_fan && attr == hwmon_fan_target) {
+		*val = READ_ONCE(drvdata->pid[channel].target_rpm);
+		return 0;
+	}
+
+	if (type == hwmon_fan && attr == hwmon_fan_min) {
+		*val = READ_ONCE(drvdata->fan_min[channel]);
+		return 0;
+	}
+
+	if (type == hwmon_curr && attr == hwmon_curr_max) {
+		*val = READ_ONCE(drvdata->curr_max[channel]);
+		return 0;
+	}
+
+	if (type == hwmon_pwm && attr == hwmon_pwm_input) {
+		res = take_pwm_error(drvdata, channel);
+		if (res)
+			return res;
+	}
+
+	received = sample_received_flag(drvdata, type, attr);
+	if (!received)
+		return -EINVAL;
+
+	trace_nzxt_smart2_read_wait_begin(dev, type, attr, channel, 0);
+	start = ktime_get();
+
+	/* pwm reads always wait: fancontrol expects them to succeed */
+	if (type == hwmon_pwm)
+		res = wait_sample_received(drvdata, received);
+	else
+		res = wait_sample_received_timeout(drvdata, received,
+						   READ_ONCE(read_timeout_ms));
+	stat_hist_add(drvdata, STAT_HIST_READ_WAIT,
+		      ktime_us_delta(ktime_get(), start));
+	trace_nzxt_smart2_read_wait_end(dev, type, attr, channel, res);
+	if (res)
+		return res;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		*val = sample_value(drvdata, type, attr, channel);
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	mark_sample_consumed(drvdata);
+	return 0;
+}
+
+static int __send_output_report(struct drvdata *drvdata, const void *data,
+				size_t data_size)
+{
+	const u8 *bytes = data;
+	ktime_t start, duration;
+	u8 mask;
+	int ret;
+
+	if (data_size > sizeof(drvdata->output_buffer))
+		return -EINVAL;
+
+	memcpy(drvdata->output_buffer, data, data_size);
+
+	if (data_size < sizeof(drvdata->output_buffer))
+		memset(drvdata->output_buffer + data_size, 0,
+		       sizeof(drvdata->output_buffer) - data_size);
+
+	start = ktime_get();
+	ret = hid_hw_output_report(drvdata->hid, drvdata->output_buffer,
+				   sizeof(drvdata->output_buffer));
+	ret = ret < 0 ? ret : 0;
+	duration = ktime_sub(ktime_get(), start);
+
+	stat_inc(drvdata, ret ? STAT_OUTPUT_ERRORS : STAT_OUTPUT_REPORTS);
+	stat_hist_add(drvdata, STAT_HIST_OUTPUT, ktime_to_us(duration));
+
+	if (trace_nzxt_smart2_output_report_enabled()) {
+		/* Channel mask, or init command id */
+		mask = bytes[0] == OUTPUT_REPORT_ID_SET_FAN_SPEED ? bytes[2] : bytes[1];
+		trace_nzxt_smart2_output_report(drvdata->hid, bytes[0], mask,
+						ktime_to_ns(duration), ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Sends all fire-and-forget reports from output_queue. Must be called with
+ * mutex held.
+ */
+static void flush_output_queue(struct drvdata *drvdata)
+{
+	struct set_fan_speed_report *report;
+	unsigned int tail;
+	int ret;
+
+	for (;;) {
+		/* Only this function changes the tail, under mutex */
+		tail = drvdata->output_queue_tail;
+
+		spin_lock(&drvdata->output_queue_lock);
+		if (tail == drvdata->output_queue_head) {
+			spin_unlock(&drvdata->output_queue_lock);
+			return;
+		}
+		spin_unlock(&drvdata->output_queue_lock);
+
+		/* Producers don't touch the entry until the tail moves past it */
+		report = &drvdata->output_queue[tail % OUTPUT_QUEUE_LEN];
+		ret = __send_output_report(drvdata, report, sizeof(*report));
+		if (ret)
+			set_pwm_error(drvdata, report->channel_bit_mask, ret);
+		else
+			stat_inc(drvdata, STAT_PWM_REPORTS);
+
+		spin_lock(&drvdata->output_queue_lock);
+		drvdata->output_queue_tail = tail + 1;
+		spin_unlock(&drvdata->output_queue_lock);
+	}
+}
+
+static void output_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, output_work);
+
+	lock_drvdata(drvdata);
+	flush_output_queue(drvdata);
+	mutex_unlock(&drvdata->mutex);
+}
+
+/*
+ * Sends an output report. Fire-and-forget reports that were queued earlier
+ * are sent first, to keep the order. Must be called with mutex held.
+ */
+static int send_output_report(struct drvdata *drvdata, const void *data,
+			      size_t data_size)
+{
+	flush_output_queue(drvdata);
+
+	return __send_output_report(drvdata, data, data_size);
+}
+
+static void fill_fan_speed_report(struct set_fan_speed_report *report,
+				  u8 channel_mask, const u8 *duty_percent)
+{
+	int i;
+
+	memset(report, 0, sizeof(*report));
+	report->report_id = OUTPUT_REPORT_ID_SET_FAN_SPEED;
+	report->magic = 1;
+	report->channel_bit_mask = channel_mask;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (channel_mask & BIT(i))
+			report->duty_percent[i] = duty_percent[i];
+	}
+}
+
+/*
+ * pwmconfig and fancontrol scripts expect pwm writes to take effect
+ * immediately (i. e. read from pwm* sysfs should return the value written into
+ * it). The device seems to always accept pwm values - even when there is no
+ * fan connected - so update pwm status without waiting for a report, to make
+ * pwmconfig and fancontrol happy. Worst case - if the device didn't accept new
+ * pwm value for some reason (never seen this in practice) - it will be
+ * reported incorrectly only until next update. This avoids "fan stuck"
+ * messages from pwmconfig, and fancontrol setting fan speed to 100% during
+ * shutdown.
+ */
+static void update_cached_duty(struct drvdata *drvdata, u8 channel_mask,
+			       const u8 *duty_percent)
+{
+	int i;
+
+	spin_lock_bh(&drvdata->wq.lock);
+	write_seqcount_begin(&drvdata->sample_seq);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (channel_mask & BIT(i)) {
+			drvdata->fan_duty_percent[i] = duty_percent[i];
+			drvdata->duty_set[i] = duty_percent[i];
+		}
+	}
+
+	drvdata->duty_set_mask |= channel_mask;
+
+	write_seqcount_end(&drvdata->sample_seq);
+	spin_unlock_bh(&drvdata->wq.lock);
+}
+
+/*
+ * Sends one SET_FAN_SPEED report for all channels in channel_mask. Must be
+ * called with mutex held.
+ */
+static int send_fan_speed_report(struct drvdata *drvdata, u8 channel_mask,
+				 const u8 *duty_percent)
+{
+	struct set_fan_speed_report report;
+	int ret;
+
+	fill_fan_speed_report(&report, channel_mask, duty_percent);
+
+	ret = send_output_report(drvdata, &report, sizeof(report));
+	if (ret)
+		return ret;
+
+	stat_inc(drvdata, STAT_PWM_REPORTS);
+	update_cached_duty(drvdata, channel_mask, duty_percent);
+	return 0;
+}
+
+/*
+ * Adds a SET_FAN_SPEED report to output_queue, without waiting for it to be
+ * sent. Returns -ENOSPC if the queue is full.
+ */
+static int queue_fan_speed_report(struct drvdata *drvdata, u8 channel_mask,
+				  const u8 *duty_percent)
+{
+	unsigned int head;
+
+	spin_lock(&drvdata->output_queue_lock);
+
+	head = drvdata->output_queue_head;
+	if (head - drvdata->output_queue_tail >= OUTPUT_QUEUE_LEN) {
+		spin_unlock(&drvdata->output_queue_lock);
+		return -ENOSPC;
+	}
+
+	fill_fan_speed_report(&drvdata->output_queue[head % OUTPUT_QUEUE_LEN],
+			      channel_mask, duty_percent);
+	drvdata->output_queue_head = head + 1;
+	stat_inc(drvdata, STAT_PWM_ASYNC_WRITES);
+
+	/* Under output_queue_lock, so that the cache follows the queue order */
+	update_cached_duty(drvdata, channel_mask, duty_percent);
+
+	spin_unlock(&drvdata->output_queue_lock);
+
+	queue_work(drvdata->output_wq, &drvdata->output_work);
+	return 0;
+}
+
+/*
+ * Returns true if duty_percent is already set on the channel, or will be set
+ * by the batch that is being collected. Must be called with mutex held.
+ */
+static bool pwm_unchanged(struct drvdata *drvdata, int channel, u8 duty_percent)
+{
+	unsigned int seq;
+	bool unchanged;
+
+	if (drvdata->pwm_pending_mask & BIT(channel))
+		return drvdata->pwm_pending_duty[channel] == duty_percent;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		unchanged = drvdata->pwm_status_received &&
+			    drvdata->fan_duty_percent[channel] == duty_percent;
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	return unchanged;
+}
+
+static void pwm_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(to_delayed_work(work),
+					       struct drvdata, pwm_work);
+	int ret = 0;
+
+	lock_drvdata(drvdata);
+
+	if (drvdata->pwm_pending_mask)
+		ret = send_fan_speed_report(drvdata, drvdata->pwm_pending_mask,
+					    drvdata->pwm_pending_duty);
+
+	/* Nobody waits for fire-and-forget writes, report errors later */
+	if (ret)
+		set_pwm_error(drvdata,
+			      drvdata->pwm_pending_mask & drvdata->pwm_pending_async_mask,
+			      ret);
+
+	drvdata->pwm_pending_mask = 0;
+	drvdata->pwm_pending_async_mask = 0;
+
+	WRITE_ONCE(drvdata->pwm_batch_error, ret);
+	smp_store_release(&drvdata->pwm_batch_done, drvdata->pwm_batch);
+	drvdata->pwm_batch++;
+
+	mutex_unlock(&drvdata->mutex);
+
+	wake_up_all(&drvdata->pwm_batch_wq);
+}
+
+static bool pwm_batch_done(struct drvdata *drvdata, unsigned long batch)
+{
+	return (long)(smp_load_acquire(&drvdata->pwm_batch_done) - batch) >= 0;
+}
+
+/*
+ * Moves the ramp of the channel by elapsed_ms towards its target, returns the
+ * new duty cycle (in percent). Must be called with mutex held.
+ */
+static u8 ramp_step(struct drvdata *drvdata, int channel,
+		    unsigned int elapsed_ms)
+{
+	unsigned int target = drvdata->ramp_target[channel] * RAMP_SCALE;
+	unsigned int pos = drvdata->ramp_pos[channel];
+	u64 step;
+
+	/* ramp_rate is in pwm units (0-255) per second */
+	step = div_u64((u64)drvdata->ramp_rate[channel] * elapsed_ms * 100 *
+		       RAMP_SCALE, 255 * MSEC_PER_SEC);
+
+	if (pos < target)
+		pos += min_t(u64, step, target - pos);
+	else
+		pos -= min_t(u64, step, pos - target);
+
+	drvdata->ramp_pos[channel] = pos;
+	if (pos == target)
+		drvdata->ramp_mask &= ~BIT(channel);
+
+	return DIV_ROUND_CLOSEST(pos, RAMP_SCALE);
+}
+
+static void ramp_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(to_delayed_work(work),
+					       struct drvdata, ramp_work);
+	u8 duty_percent[FAN_CHANNELS] = {};
+	unsigned long now = jiffies;
+	unsigned int elapsed_ms;
+	u8 channel_mask = 0;
+	int i, ret;
+
+	lock_drvdata(drvdata);
+
+	elapsed_ms = jiffies_to_msecs(now - drvdata->ramp_time);
+	drvdata->ramp_time = now;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		u8 prev;
+
+		if (!(drvdata->ramp_mask & BIT(i)))
+			continue;
+
+		prev = DIV_ROUND_CLOSEST(drvdata->ramp_pos[i], RAMP_SCALE);
+		duty_percent[i] = ramp_step(drvdata, i, elapsed_ms);
+
+		/* Slow ramps don't change the duty cycle on every step */
+		if (duty_percent[i] != prev)
+			channel_mask |= BIT(i);
+	}
+
+	/* All ramping channels in one report */
+	if (channel_mask) {
+		ret = send_fan_speed_report(drvdata, channel_mask, duty_percent);
+		/* Nobody waits for the ramp, report errors later */
+		if (ret)
+			set_pwm_error(drvdata, channel_mask, ret);
+	}
+
+	if (drvdata->ramp_mask)
+		queue_delayed_work(drvdata->output_wq, &drvdata->ramp_work,
+				   msecs_to_jiffies(RAMP_PERIOD_MS));
+
+	mutex_unlock(&drvdata->mutex);
+}
+
+/*
+ * Starts a ramp from the current duty cycle of the channel to duty (or
+ * retargets the ramp that is already in progress). Must be called with mutex
+ * held.
+ */
+static void start_ramp(struct drvdata *drvdata, int channel, u8 duty)
+{
+	unsigned int seq;
+	u8 current_duty;
+
+	drvdata->ramp_target[channel] = duty;
+
+	if (drvdata->ramp_mask & BIT(channel))
+		return;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		current_duty = drvdata->fan_duty_percent[channel];
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	if (current_duty == duty)
+		return;
+
+	drvdata->ramp_pos[channel] = current_duty * RAMP_SCALE;
+
+	/* The ramp overrides a coalesced write that wasn't sent yet */
+	drvdata->pwm_pending_mask &= ~BIT(channel);
+	drvdata->pwm_pending_async_mask &= ~BIT(channel);
+
+	if (!drvdata->ramp_mask) {
+		drvdata->ramp_time = jiffies;
+		queue_delayed_work(drvdata->output_wq, &drvdata->ramp_work,
+				   msecs_to_jiffies(RAMP_PERIOD_MS));
+	}
+
+	drvdata->ramp_mask |= BIT(channel);
+}
+
+/*
+ * Must be called without mutex: thermal_zone_get_temp() takes the thermal
+ * zone lock, and thermal governors call fan_cooling_set_cur_state() (which
+ * takes mutex) with that lock held.
+ */
+static int read_curve_temp(const char *temp_source, int *temp)
+{
+	struct thermal_zone_device *tz;
+
+	if (!temp_source[0])
+		return -ENOENT;
+
+	tz = thermal_zone_get_zone_by_name(temp_source);
+	if (IS_ERR(tz))
+		return PTR_ERR(tz);
+
+	return thermal_zone_get_temp(tz, temp);
+}
+
+/* Returns the duty cycle for the curve, in percent. Updates last_temp. */
+static u8 curve_duty_percent(struct fan_curve *curve, int temp)
+{
+	long pwm;
+	int i;
+
+	temp = clamp(temp, CURVE_TEMP_MIN, CURVE_TEMP_MAX);
+
+	if (curve->last_temp_valid && temp < curve->last_temp &&
+	    temp > curve->last_temp - curve->temp_hyst)
+		temp = curve->last_temp;
+
+	curve->last_temp = temp;
+	curve->last_temp_valid = true;
+
+	pwm = curve->pwm[CURVE_POINTS - 1];
+
+	if (temp <= curve->temp[0]) {
+		pwm = curve->pwm[0];
+	} else {
+		for (i = 1; i < CURVE_POINTS; i++) {
+			if (temp >= curve->temp[i])
+				continue;
+
+			/* temp[i - 1] < temp < temp[i] */
+			pwm = curve->pwm[i - 1] +
+			      DIV_ROUND_CLOSEST((curve->pwm[i] - curve->pwm[i - 1]) *
+						(temp - curve->temp[i - 1]),
+						curve->temp[i] - curve->temp[i - 1]);
+			break;
+		}
+	}
+
+	return scale_pwm_value(pwm, 255, 100);
+}
+
+/* Point temperatures must increase, for the interpolation */
+static bool curve_points_valid(const struct fan_curve *curve)
+{
+	int i;
+
+	for (i = 1; i < CURVE_POINTS; i++) {
+		if (curve->temp[i] <= curve->temp[i - 1])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the duty cycle for the temperature read by read_curve_temp() (or
+ * its error). Must be called with mutex held.
+ */
+static u8 curve_control(struct drvdata *drvdata, int channel, int ret, int temp)
+{
+	struct fan_curve *curve = &drvdata->curve[channel];
+
+	if (ret) {
+		/* Fail safe: full speed */
+		dev_warn_ratelimited(&drvdata->hid->dev,
+				     "Can't read temperature from '%s' for fan %d: %d\n",
+				     curve->temp_source, channel + 1, ret);
+		curve->last_temp_valid = false;
+		return 100;
+	}
+
+	return curve_duty_percent(curve, temp);
+}
+
+/*
+ * Computes the next duty cycle for a channel in PWM_ENABLE_TARGET_RPM mode.
+ * Returns false if the duty cycle shouldn't be changed yet.
+ */
+static bool pid_control(struct drvdata *drvdata, int channel, long rpm,
+			u8 *duty_percent)
+{
+	struct fan_pid *pid = &drvdata->pid[channel];
+	long error, output, derivative;
+	unsigned int dt_ms;
+
+	if (!pid->target_rpm) {
+		/* Explicit request to stop the fan */
+		pid->integral = 0;
+		pid->running = false;
+		*duty_percent = 0;
+		return true;
+	}
+
+	if (pid->running &&
+	    time_before(jiffies, pid->last_update +
+			msecs_to_jiffies(PID_UPDATE_INTERVAL_MIN_MS)))
+		return false;
+
+	if (pid->running) {
+		dt_ms = clamp_val(jiffies_to_msecs(jiffies - pid->last_update),
+				  PID_UPDATE_INTERVAL_MIN_MS, PID_DT_MAX_MS);
+	} else {
+		pid->prev_rpm = rpm;
+		/* Use the nominal interval until there is a measured one */
+		dt_ms = clamp_val(READ_ONCE(drvdata->update_interval),
+				  PID_UPDATE_INTERVAL_MIN_MS, PID_DT_MAX_MS);
+	}
+
+	error = pid->target_rpm - rpm;
+
+	/* Clamping the integral term prevents windup */
+	pid->integral = clamp_val(pid->integral +
+				  div_s64((s64)PID_KI * error * dt_ms, MSEC_PER_SEC),
+				  0, PID_OUTPUT_MAX);
+
+	/* Derivative on measurement: no kick when the target changes */
+	derivative = PID_KD * (rpm - pid->prev_rpm) * (long)MSEC_PER_SEC / dt_ms;
+	output = PID_KP * error + pid->integral - derivative;
+
+	pid->prev_rpm = rpm;
+	pid->last_update = jiffies;
+	pid->running = true;
+
+	output = clamp_val(output, 0, PID_OUTPUT_MAX);
+
+	/* The fan should keep spinning while the target is non-zero */
+	*duty_percent = max(1L, DIV_ROUND_CLOSEST(output, 1 << PID_SHIFT));
+	return true;
+}
+
+/*
+ * Runs automatic control for all channels not in PWM_ENABLE_MANUAL mode, and
+ * sends new duty cycles as a single report.
+ */
+static void control_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, control_work);
+	char temp_source[FAN_CHANNELS][THERMAL_NAME_LENGTH];
+	int temp[FAN_CHANNELS], temp_ret[FAN_CHANNELS];
+	u8 duty_percent[FAN_CHANNELS] = {};
+	u8 policy_duty[FAN_CHANNELS];
+	u16 fan_rpm[FAN_CHANNELS];
+	u8 policy_duty_mask;
+	u8 channel_mask = 0;
+	u8 curve_mask = 0;
+	unsigned int seq;
+	int i, ret;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		memcpy(fan_rpm, drvdata->fan_rpm, sizeof(fan_rpm));
+		memcpy(policy_duty, drvdata->policy_duty, sizeof(policy_duty));
+		policy_duty_mask = drvdata->policy_duty_mask;
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	/* Temperatures are read without mutex, see read_curve_temp() */
+	lock_drvdata(drvdata);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (drvdata->control_mode[i] != PWM_ENABLE_CURVE)
+			continue;
+
+		strscpy(temp_source[i], drvdata->curve[i].temp_source,
+			sizeof(temp_source[i]));
+		curve_mask |= BIT(i);
+	}
+
+	mutex_unlock(&drvdata->mutex);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (curve_mask & BIT(i))
+			temp_ret[i] = read_curve_temp(temp_source[i], &temp[i]);
+	}
+
+	lock_drvdata(drvdata);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		switch (drvdata->control_mode[i]) {
+		case PWM_ENABLE_CURVE:
+			/*
+			 * Switched to the curve, or changed its source, while the
+			 * temperature was read. Applied on the next run.
+			 */
+			if (!(curve_mask & BIT(i)) ||
+			    strcmp(temp_source[i], drvdata->curve[i].temp_source))
+				continue;
+
+			duty_percent[i] = curve_control(drvdata, i, temp_ret[i],
+							temp[i]);
+			break;
+
+		case PWM_ENABLE_TARGET_RPM:
+			if (!pid_control(drvdata, i, fan_rpm[i], &duty_percent[i]))
+				continue;
+
+			break;
+
+		case PWM_ENABLE_POLICY:
+			/* No program attached, or it didn't decide yet */
+			if (!(policy_duty_mask & BIT(i)))
+				continue;
+
+			duty_percent[i] = policy_duty[i];
+			break;
+
+		default:
+			continue;
+		}
+
+		if (!pwm_unchanged(drvdata, i, duty_percent[i]))
+			channel_mask |= BIT(i);
+	}
+
+	if (channel_mask) {
+		ret = send_fan_speed_report(drvdata, channel_mask, duty_percent);
+		if (ret)
+			dev_warn_ratelimited(&drvdata->hid->dev,
+					     "Failed to set fan speed (channel mask 0x%x): %d\n",
+					     channel_mask, ret);
+	}
+
+	mutex_unlock(&drvdata->mutex);
+}
+
+/*
+ * Sets the duty cycle of a manually controlled channel, as requested by
+ * userspace: through pwm* or the thermal cooling device.
+ *
+ * wait_batch: with pwm_coalesce_ms, wait until the merged report is sent. The
+ * cooling device must not wait: thermal governors call it with the zone lock
+ * held, and the batch is sent from output_wq, possibly behind control_work,
+ * which reads the temperature of the same zone.
+ */
+static int set_duty_percent(struct drvdata *drvdata, int channel, u8 duty,
+			    bool wait_batch)
+{
+	u8 duty_percent[FAN_CHANNELS] = {};
+	unsigned int coalesce_ms = READ_ONCE(pwm_coalesce_ms);
+	bool async = READ_ONCE(pwm_async);
+	unsigned long batch;
+	int ret;
+
+	duty_percent[channel] = duty;
+
+	/* pwm* is controlled by the driver itself */
+	if (READ_ONCE(drvdata->control_mode[channel]) != PWM_ENABLE_MANUAL)
+		return -EBUSY;
+
+	/*
+	 * With a ramp rate set, the write only starts the ramp (nobody wants
+	 * to block for seconds), pwm* reads show its progress.
+	 */
+	if (READ_ONCE(drvdata->ramp_rate[channel])) {
+		ret = take_pwm_error(drvdata, channel);
+		if (ret)
+			return ret;
+
+		ret = lock_drvdata_interruptible(drvdata);
+		if (ret)
+			return ret;
+
+		stat_inc(drvdata, STAT_PWM_WRITES);
+
+		if (drvdata->ramp_rate[channel])
+			start_ramp(drvdata, channel, duty);
+		else
+			ret = send_fan_speed_report(drvdata, BIT(channel),
+						    duty_percent);
+
+		mutex_unlock(&drvdata->mutex);
+		return ret;
+	}
+
+	if (async) {
+		ret = take_pwm_error(drvdata, channel);
+		if (ret)
+			return ret;
+
+		/*
+		 * Without coalescing, don't even take the mutex. If the queue
+		 * is full, fall back to a blocking write.
+		 */
+		if (!coalesce_ms &&
+		    !queue_fan_speed_report(drvdata, BIT(channel), duty_percent))
+			return 0;
+	}
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	stat_inc(drvdata, STAT_PWM_WRITES);
+
+	if (!coalesce_ms) {
+		ret = send_fan_speed_report(drvdata, BIT(channel), duty_percent);
+		mutex_unlock(&drvdata->mutex);
+		return ret;
+	}
+
+	if (pwm_unchanged(drvdata, channel, duty_percent[channel])) {
+		stat_inc(drvdata, STAT_PWM_WRITES_UNCHANGED);
+		mutex_unlock(&drvdata->mutex);
+		return 0;
+	}
+
+	drvdata->pwm_pending_duty[channel] = duty_percent[channel];
+	drvdata->pwm_pending_mask |= BIT(channel);
+	if (async || !wait_batch)
+		drvdata->pwm_pending_async_mask |= BIT(channel);
+	batch = drvdata->pwm_batch;
+
+	/* Doesn't restart the window if the work is already pending */
+	queue_delayed_work(drvdata->output_wq, &drvdata->pwm_work,
+			   msecs_to_jiffies(coalesce_ms));
+
+	mutex_unlock(&drvdata->mutex);
+
+	if (async || !wait_batch)
+		return 0;
+
+	/*
+	 * Keep the blocking semantics: pwmconfig expects the new value to be
+	 * in effect when the write returns.
+	 */
+	ret = wait_event_interruptible(drvdata->pwm_batch_wq,
+				       pwm_batch_done(drvdata, batch));
+	if (ret)
+		return ret;
+
+	return READ_ONCE(drvdata->pwm_batch_error);
+}
+
+static int set_pwm(struct drvdata *drvdata, int channel, long val)
+{
+	return set_duty_percent(drvdata, channel, scale_pwm_value(val, 255, 100),
+				true);
+}
+
+/*
+ * Channels without a fan can't be controlled at all, pwm*_enable is always 0
+ * for them. Still, accept writes of the current value: fancontrol/pwmconfig
+ * try to write to pwm*_enable even if it already has the desired value, and
+ * fancontrol won't restore pwm on shutdown properly otherwise.
+ */
+static int set_pwm_enable(struct drvdata *drvdata, int channel, long val)
+{
+	bool fan_connected;
+	unsigned int seq;
+	int res;
+
+	res = wait_sample_received(drvdata, &drvdata->fan_config_received);
+	if (res)
+		return res;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		fan_connected = drvdata->fan_type[channel] != FAN_TYPE_NONE;
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	if (!fan_connected)
+		return val == 0 ? 0 : -EOPNOTSUPP;
+
+	switch (val) {
+	case 0:
+		return -EOPNOTSUPP;
+
+	case PWM_ENABLE_MANUAL:
+	case PWM_ENABLE_CURVE:
+	case PWM_ENABLE_TARGET_RPM:
+	case PWM_ENABLE_POLICY:
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	res = lock_drvdata_interruptible(drvdata);
+	if (res)
+		return res;
+
+	if (val == PWM_ENABLE_CURVE &&
+	    (!drvdata->curve[channel].temp_source[0] ||
+	     !curve_points_valid(&drvdata->curve[channel]))) {
+		res = -EINVAL;
+		goto unlock;
+	}
+
+	/* Target 0 would stop the fan right away, it must be set explicitly */
+	if (val == PWM_ENABLE_TARGET_RPM && !drvdata->pid[channel].target_rpm) {
+		res = -EINVAL;
+		goto unlock;
+	}
+
+	if (val == PWM_ENABLE_TARGET_RPM &&
+	    drvdata->control_mode[channel] != PWM_ENABLE_TARGET_RPM) {
+		/* Bumpless transfer: start from the current duty cycle */
+		do {
+			seq = read_seqcount_begin(&drvdata->sample_seq);
+			drvdata->pid[channel].integral =
+				drvdata->fan_duty_percent[channel] << PID_SHIFT;
+		} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+		drvdata->pid[channel].running = false;
+	}
+
+	drvdata->control_mode[channel] = val;
+	drvdata->curve[channel].last_temp_valid = false;
+
+	/* Ramps are for manual writes only */
+	if (val != PWM_ENABLE_MANUAL)
+		drvdata->ramp_mask &= ~BIT(channel);
+
+	if (val == PWM_ENABLE_MANUAL)
+		WRITE_ONCE(drvdata->control_mask, drvdata->control_mask & ~BIT(channel));
+	else
+		WRITE_ONCE(drvdata->control_mask, drvdata->control_mask | BIT(channel));
+
+	/* Old policy decisions are not applied when the mode is entered again */
+	spin_lock_bh(&drvdata->wq.lock);
+	write_seqcount_begin(&drvdata->sample_seq);
+	drvdata->policy_duty_mask &= ~BIT(channel);
+	write_seqcount_end(&drvdata->sample_seq);
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	if (val == PWM_ENABLE_POLICY)
+		WRITE_ONCE(drvdata->policy_mask, drvdata->policy_mask | BIT(channel));
+	else
+		WRITE_ONCE(drvdata->policy_mask, drvdata->policy_mask & ~BIT(channel));
+
+	/* Don't wait for the next report to apply the curve */
+	if (val != PWM_ENABLE_MANUAL)
+		queue_work(drvdata->output_wq, &drvdata->control_work);
+
+unlock:
+	mutex_unlock(&drvdata->mutex);
+	return res;
+}
+
+static int set_fan_target(struct drvdata *drvdata, int channel, long val)
+{
+	int ret;
+
+	if (val < 0 || val > FAN_TARGET_RPM_MAX)
+		return -EINVAL;
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->pid[channel].target_rpm, val);
+
+	mutex_unlock(&drvdata->mutex);
+	return 0;
+}
+
+/*
+ * Cooling state 0 turns the fan off, cooling_states - full speed. Other
+ * states are spread evenly over the duty cycle range.
+ */
+static int fan_cooling_get_max_state(struct thermal_cooling_device *cdev,
+				     unsigned long *state)
+{
+	*state = cooling_states;
+	return 0;
+}
+
+static int fan_cooling_get_cur_state(struct thermal_cooling_device *cdev,
+				     unsigned long *state)
+{
+	struct fan_cooling *cooling = cdev->devdata;
+	struct drvdata *drvdata = cooling->drvdata;
+	unsigned int seq;
+	u8 duty_percent;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		duty_percent = drvdata->fan_duty_percent[cooling->channel];
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	*state = DIV_ROUND_CLOSEST(duty_percent * cooling_states, 100);
+	return 0;
+}
+
+static int fan_cooling_set_cur_state(struct thermal_cooling_device *cdev,
+				     unsigned long state)
+{
+	struct fan_cooling *cooling = cdev->devdata;
+
+	if (state > cooling_states)
+		return -EINVAL;
+
+	return set_duty_percent(cooling->drvdata, cooling->channel,
+				DIV_ROUND_CLOSEST(state * 100, cooling_states),
+				false);
+}
+
+static const struct thermal_cooling_device_ops fan_cooling_ops = {
+	.get_max_state = fan_cooling_get_max_state,
+	.get_cur_state = fan_cooling_get_cur_state,
+	.set_cur_state = fan_cooling_set_cur_state,
+};
+
+/*
+ * Registers cooling devices for channels with a fan detected, and unregisters
+ * them for channels without one.
+ */
+static void cooling_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, cooling_work);
+	struct thermal_cooling_device *cdev;
+	struct fan_cooling *cooling;
+	u8 fan_type[FAN_CHANNELS];
+	char name[THERMAL_NAME_LENGTH];
+	unsigned int seq;
+	int i;
+
+	/* Without thermal core, registration fails (with ENODEV) for every fan */
+	if (!IS_ENABLED(CONFIG_THERMAL) || !cooling_states)
+		return;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		if (!drvdata->fan_config_received)
+			return;
+
+		memcpy(fan_type, drvdata->fan_type, sizeof(fan_type));
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		cooling = &drvdata->cooling[i];
+
+		if (fan_type[i] == FAN_TYPE_NONE) {
+			if (cooling->cdev) {
+				thermal_cooling_device_unregister(cooling->cdev);
+				cooling->cdev = NULL;
+			}
+
+			continue;
+		}
+
+		if (cooling->cdev)
+			continue;
+
+		scnprintf(name, sizeof(name), "nzxt-smart2-fan%d", i + 1);
+
+		cdev = thermal_cooling_device_register(name, cooling,
+						       &fan_cooling_ops);
+		if (IS_ERR(cdev)) {
+			hid_warn(drvdata->hid,
+				 "Failed to register cooling device for fan %d: %ld\n",
+				 i + 1, PTR_ERR(cdev));
+			continue;
+		}
+
+		cooling->cdev = cdev;
+	}
+}
+
+static void unregister_cooling_devices(struct drvdata *drvdata)
+{
+	int i;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (drvdata->cooling[i].cdev)
+			thermal_cooling_device_unregister(drvdata->cooling[i].cdev);
+
+		drvdata->cooling[i].cdev = NULL;
+	}
+}
+
+static int set_update_control(struct drvdata *drvdata, u8 control)
+{
+	u8 report[] = {
+		OUTPUT_REPORT_ID_INIT_COMMAND,
+		INIT_COMMAND_SET_UPDATE_INTERVAL,
+		0x01,
+		0xe8,
+		control,
+		0x01,
+		0xe8,
+		control,
+	};
+	int ret;
+
+	ret = send_output_report(drvdata, report, sizeof(report));
+	if (ret)
+		return ret;
+
+	spin_lock_bh(&drvdata->wq.lock);
+	WRITE_ONCE(drvdata->update_interval,
+		   measured_update_interval(drvdata, control));
+	report_timing_reset(drvdata, control);
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	return 0;
+}
+
+static int set_update_interval(struct drvdata *drvdata, long val)
+{
+	u8 control;
+
+	spin_lock_bh(&drvdata->wq.lock);
+	control = update_interval_to_control_byte(drvdata, val, false);
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	return set_update_control(drvdata, control);
+}
+
+static void interval_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, interval_work);
+	bool changed = false;
+	u8 control;
+	int ret = 0;
+
+	lock_drvdata(drvdata);
+
+	if (drvdata->adaptive.enabled) {
+		spin_lock_bh(&drvdata->wq.lock);
+		control = adaptive_interval_control(drvdata);
+		changed = control != drvdata->update_control;
+		spin_unlock_bh(&drvdata->wq.lock);
+	}
+
+	if (changed)
+		ret = set_update_control(drvdata, control);
+
+	mutex_unlock(&drvdata->mutex);
+
+	if (ret)
+		dev_warn_ratelimited(&drvdata->hid->dev,
+				     "Failed to set update interval: %d\n", ret);
+}
+
+static void restore_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, restore_work);
+	u8 duty_percent[FAN_CHANNELS];
+	u8 channel_mask;
+	int ret = 0;
+
+	lock_drvdata(drvdata);
+
+	spin_lock_bh(&drvdata->wq.lock);
+	memcpy(duty_percent, drvdata->duty_set, sizeof(duty_percent));
+	channel_mask = drvdata->duty_set_mask;
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	if (channel_mask)
+		ret = send_fan_speed_report(drvdata, channel_mask, duty_percent);
+
+	mutex_unlock(&drvdata->mutex);
+
+	if (ret)
+		hid_warn(drvdata->hid, "Failed to restore pwm values: %d\n", ret);
+	else
+		hid_dbg(drvdata->hid,
+			"pwm values restored %lld us after fan detection start\n",
+			ktime_us_delta(ktime_get(), drvdata->detect_time));
+}
+
+static void set_fan_detect_pending(struct drvdata *drvdata, bool pending)
+{
+	bool stale;
+
+	spin_lock_bh(&drvdata->wq.lock);
+	write_seqcount_begin(&drvdata->sample_seq);
+
+	stale = pending && (drvdata->pwm_status_received ||
+			    drvdata->voltage_status_received);
+
+	drvdata->fan_detect_pending = pending;
+	drvdata->sample_types = 0;
+	/* Status reports are dropped until detection completes */
+	drvdata->voltage_time = 0;
+
+	if (drvdata->sample_stale != stale) {
+		drvdata->sample_stale = stale;
+		set_bit(NOTIFY_STALE, &drvdata->notify_pending);
+		if (drvdata->work_enabled)
+			schedule_work(&drvdata->notify_work);
+	}
+
+	write_seqcount_end(&drvdata->sample_seq);
+	spin_unlock_bh(&drvdata->wq.lock);
+}
+
+/*
+ * Sends "detect fans" command. Fan detection resets pwm values, so they are
+ * restored by restore_work when it completes. Must be called with mutex held.
+ */
+static int detect_fans(struct drvdata *drvdata)
+{
+	int ret;
+	u8 detect_fans_report[] = {
+		OUTPUT_REPORT_ID_INIT_COMMAND,
+		INIT_COMMAND_DETECT_FANS,
+	};
+
+	drvdata->detect_time = ktime_get();
+	set_fan_detect_pending(drvdata, true);
+
+	ret = send_output_report(drvdata, detect_fans_report,
+				 sizeof(detect_fans_report));
+	if (ret)
+		set_fan_detect_pending(drvdata, false);
+
+	return ret;
+}
+
+static void detect_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, detect_work);
+	int ret;
+
+	hid_info(drvdata->hid, "Fan speed reported for a channel without a fan, detecting fans\n");
+
+	lock_drvdata(drvdata);
+	ret = detect_fans(drvdata);
+	mutex_unlock(&drvdata->mutex);
+
+	if (ret)
+		hid_warn(drvdata->hid, "Failed to detect fans: %d\n", ret);
+}
+
+static int init_device(struct drvdata *drvdata, long update_interval)
+{
+	int ret;
+
+	ret = detect_fans(drvdata);
+	if (ret)
+		return ret;
+
+	return set_update_interval(drvdata, update_interval);
+}
+
+static void init_work_fn(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(work, struct drvdata, init_work);
+	int ret;
+
+	lock_drvdata(drvdata);
+	ret = init_device(drvdata, UPDATE_INTERVAL_DEFAULT_MS);
+	mutex_unlock(&drvdata->mutex);
+
+	/* Pairs with smp_load_acquire() in wait_device_init() */
+	smp_store_release(&drvdata->init_done, true);
+
+	if (ret)
+		hid_warn(drvdata->hid, "Failed to initialize the device: %d\n", ret);
+
+	if (READ_ONCE(boot_timing))
+		hid_info(drvdata->hid, "device initialized %lld us after probe\n",
+			 ktime_us_delta(ktime_get(), drvdata->probe_time));
+}
+
+/*
+ * Output reports sent before fan detection would be overridden by it, so
+ * writes have to wait for init_work.
+ */
+static void wait_device_init(struct drvdata *drvdata)
+{
+	if (unlikely(!smp_load_acquire(&drvdata->init_done)))
+		flush_work(&drvdata->init_work);
+}
+
+static int nzxt_smart2_hwmon_write(struct device *dev,
+				   enum hwmon_sensor_types type, u32 attr,
+				   int channel, long val)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int ret;
+
+	wait_device_init(drvdata);
+
+	switch (type) {
+	case hwmon_fan:
+		switch (attr) {
+		case hwmon_fan_target:
+			return set_fan_target(drvdata, channel, val);
+
+		case hwmon_fan_min:
+			WRITE_ONCE(drvdata->fan_min[channel],
+				   clamp_val(val, 0, U16_MAX));
+			return 0;
+
+		default:
+			return -EINVAL;
+		}
+
+	case hwmon_curr:
+		switch (attr) {
+		case hwmon_curr_max:
+			WRITE_ONCE(drvdata->curr_max[channel],
+				   clamp_val(val, 0, U16_MAX));
+			return 0;
+
+		default:
+			return -EINVAL;
+		}
+
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_enable:
+			return set_pwm_enable(drvdata, channel, val);
+
+		case hwmon_pwm_input:
+			return set_pwm(drvdata, channel, val);
+
+		default:
+			return -EINVAL;
+		}
+
+	case hwmon_chip:
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			ret = lock_drvdata_interruptible(drvdata);
+			if (ret)
+				return ret;
+
+			/* An explicit interval turns adaptive mode off */
+			WRITE_ONCE(drvdata->adaptive.enabled, false);
+			ret = set_update_interval(drvdata, val);
+
+			mutex_unlock(&drvdata->mutex);
+			return ret;
+
+		default:
+			return -EINVAL;
+		}
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int nzxt_smart2_hwmon_read_string(struct device *dev,
+					 enum hwmon_sensor_types type, u32 attr,
+					 int channel, const char **str)
+{
+	switch (type) {
+	case hwmon_fan:
+		*str = fan_label[channel];
+		return 0;
+	case hwmon_curr:
+		*str = curr_label[channel];
+		return 0;
+	case hwmon_in:
+		*str = in_label[channel];
+		return 0;
+	case hwmon_power:
+		*str = power_label[channel];
+		return 0;
+	case hwmon_energy:
+		*str = energy_label[channel];
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static ssize_t sample_count_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int seq;
+	u64 count;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		count = drvdata->sample_count;
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	mark_sample_consumed(drvdata);
+
+	return sysfs_emit(buf, "%llu\n", count);
+}
+
+static DEVICE_ATTR_RO(sample_count);
+
+static ssize_t sample_stale_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int seq;
+	bool stale;
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+		stale = drvdata->sample_stale;
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
+
+	return sysfs_emit(buf, "%d\n", stale);
+}
+
+static DEVICE_ATTR_RO(sample_stale);
+
+static ssize_t update_interval_auto_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(drvdata->adaptive.enabled));
+}
+
+static ssize_t update_interval_auto_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	if (val && !drvdata->adaptive.enabled) {
+		spin_lock_bh(&drvdata->wq.lock);
+		adaptive_interval_reset(drvdata);
+		drvdata->adaptive.target = -1;
+		spin_unlock_bh(&drvdata->wq.lock);
+	}
+
+	WRITE_ONCE(drvdata->adaptive.enabled, val);
+
+	mutex_unlock(&drvdata->mutex);
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_interval_auto);
+
+static ssize_t rescan_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	if (!val)
+		return count;
+
+	wait_device_init(drvdata);
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	spin_lock_bh(&drvdata->wq.lock);
+	drvdata->auto_detect_ignore_mask = 0;
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	ret = detect_fans(drvdata);
+
+	mutex_unlock(&drvdata->mutex);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR_WO(rescan);
+
+static ssize_t curve_temp_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+
+	return sysfs_emit(buf, "%d\n",
+			  READ_ONCE(drvdata->curve[sattr->nr].temp[sattr->index]));
+}
+
+static ssize_t curve_temp_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct fan_curve *curve = &drvdata->curve[sattr->nr];
+	int ret, val, old;
+
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	if (val < CURVE_TEMP_MIN || val > CURVE_TEMP_MAX)
+		return -EINVAL;
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	old = curve->temp[sattr->index];
+	WRITE_ONCE(curve->temp[sattr->index], val);
+
+	/*
+	 * Points can be out of order while they are being edited, but not
+	 * while the curve is in use.
+	 */
+	if (drvdata->control_mode[sattr->nr] == PWM_ENABLE_CURVE &&
+	    !curve_points_valid(curve)) {
+		WRITE_ONCE(curve->temp[sattr->index], old);
+		ret = -EINVAL;
+	}
+
+	mutex_unlock(&drvdata->mutex);
+	return ret ? ret : count;
+}
+
+static ssize_t curve_pwm_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->curve[sattr->nr].pwm[sattr->index]));
+}
+
+static ssize_t curve_pwm_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	u8 val;
+	int ret;
+
+	ret = kstrtou8(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->curve[sattr->nr].pwm[sattr->index], val);
+
+	mutex_unlock(&drvdata->mutex);
+	return count;
+}
+
+static ssize_t curve_temp_hyst_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
 
-		default:
-			return 0444;
-		}
+	return sysfs_emit(buf, "%d\n",
+			  READ_ONCE(drvdata->curve[channel].temp_hyst));
+}
 
-	case hwmon_chip:
-		switch (attr) {
-		case hwmon_chip_update_interval:
-			return 0644;
+static ssize_t curve_temp_hyst_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	int ret, val;
 
-		default:
-			return 0444;
-		}
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
 
-	default:
-		return 0444;
-	}
+	if (val < 0 || val > CURVE_TEMP_MAX - CURVE_TEMP_MIN)
+		return -EINVAL;
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->curve[channel].temp_hyst, val);
+
+	mutex_unlock(&drvdata->mutex);
+	return count;
 }
 
-static int nzxt_smart2_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
-				  u32 attr, int channel, long *val)
+static ssize_t curve_temp_source_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
 	struct drvdata *drvdata = dev_get_drvdata(dev);
-	int res = -EINVAL;
+	int channel = to_sensor_dev_attr(attr)->index;
+	ssize_t ret;
 
-	if (type == hwmon_chip) {
-		switch (attr) {
-		case hwmon_chip_update_interval:
-			*val = drvdata->update_interval;
-			return 0;
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
 
-		default:
-			return -EINVAL;
-		}
+	ret = sysfs_emit(buf, "%s\n", drvdata->curve[channel].temp_source);
+
+	mutex_unlock(&drvdata->mutex);
+	return ret;
+}
+
+static ssize_t curve_temp_source_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	/* One more byte for the trailing newline */
+	char source[THERMAL_NAME_LENGTH + 1];
+	char *name;
+	int ret;
+
+	if (strscpy(source, buf, sizeof(source)) < 0)
+		return -EINVAL;
+
+	name = strim(source);
+	if (strlen(name) >= THERMAL_NAME_LENGTH)
+		return -EINVAL;
+
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
+
+	/* Can't switch the curve to "no source" while it's in use */
+	if (!name[0] && drvdata->control_mode[channel] == PWM_ENABLE_CURVE) {
+		ret = -EBUSY;
+	} else {
+		strscpy(drvdata->curve[channel].temp_source, name,
+			sizeof(drvdata->curve[channel].temp_source));
+		drvdata->curve[channel].last_temp_valid = false;
 	}
 
-	spin_lock_irq(&drvdata->wq.lock);
+	mutex_unlock(&drvdata->mutex);
+	return ret ? ret : count;
+}
 
-	switch (type) {
-	case hwmon_pwm:
-		/*
-		 * fancontrol:
-		 * 1) remembers pwm* values when it starts
-		 * 2) needs pwm*_enable to be 1 on controlled fans
-		 * So make sure we have correct data before allowing pwm* reads.
-		 * Returning errors for pwm of fan speed read can even cause
-		 * fancontrol to shut down. So the wait is unavoidable.
-		 */
-		switch (attr) {
-		case hwmon_pwm_enable:
-			res = wait_event_interruptible_locked_irq(drvdata->wq,
-								  drvdata->fan_config_received);
-			if (res)
-				goto unlock;
+static ssize_t ramp_rate_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
 
-			*val = drvdata->fan_type[channel] != FAN_TYPE_NONE;
-			break;
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->ramp_rate[channel]));
+}
 
-		case hwmon_pwm_mode:
-			res = wait_event_interruptible_locked_irq(drvdata->wq,
-								  drvdata->fan_config_received);
-			if (res)
-				goto unlock;
+static ssize_t ramp_rate_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned int val;
+	int ret;
 
-			*val = drvdata->fan_type[channel] == FAN_TYPE_PWM;
-			break;
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
 
-		case hwmon_pwm_input:
-			res = wait_event_interruptible_locked_irq(drvdata->wq,
-								  drvdata->pwm_status_received);
-			if (res)
-				goto unlock;
+	if (val > RAMP_RATE_MAX)
+		return -EINVAL;
 
-			*val = scale_pwm_value(drvdata->fan_duty_percent[channel],
-					       100, 255);
-			break;
-		}
-		break;
+	ret = lock_drvdata_interruptible(drvdata);
+	if (ret)
+		return ret;
 
-	case hwmon_fan:
-		/*
-		 * It's not strictly necessary to wait for *_received in the
-		 * remaining cases (fancontrol doesn't care about them). But I'm
-		 * doing it to have consistent behavior.
-		 */
-		if (attr == hwmon_fan_input) {
-			res = wait_event_interruptible_locked_irq(drvdata->wq,
-								  drvdata->pwm_status_received);
-			if (res)
-				goto unlock;
+	WRITE_ONCE(drvdata->ramp_rate[channel], val);
 
-			*val = drvdata->fan_rpm[channel];
-		}
-		break;
+	/* Cancels the ramp in progress, the fan stays where the ramp was */
+	if (!val)
+		drvdata->ramp_mask &= ~BIT(channel);
 
-	case hwmon_in:
-		if (attr == hwmon_in_input) {
-			res = wait_event_interruptible_locked_irq(drvdata->wq,
-								  drvdata->voltage_status_received);
-			if (res)
-				goto unlock;
+	mutex_unlock(&drvdata->mutex);
+	return count;
+}
 
-			*val = drvdata->fan_in[channel];
-		}
-		break;
+static SENSOR_DEVICE_ATTR_RW(pwm1_ramp_rate, ramp_rate, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_ramp_rate, ramp_rate, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_ramp_rate, ramp_rate, 2);
 
-	case hwmon_curr:
-		if (attr == hwmon_curr_input) {
-			res = wait_event_interruptible_locked_irq(drvdata->wq,
-								  drvdata->voltage_status_received);
-			if (res)
-				goto unlock;
+/*
+ * All bound devices, for fan groups. The lock is held for the whole group
+ * write, so devices can't go away while it waits for group_work.
+ */
+static LIST_HEAD(nzxt_smart2_devices);
+static DEFINE_MUTEX(nzxt_smart2_devices_lock);
+
+/* A write to group_pwm, sent to all devices in parallel */
+struct fan_group_request {
+	u8 duty_percent;
+	atomic_t pending;
+	/* The first error */
+	int error;
+	struct completion done;
+};
 
-			*val = drvdata->fan_curr[channel];
-		}
-		break;
+/* Returns -EBUSY if any of the channels isn't in manual mode */
+static int check_group_manual(struct drvdata *drvdata, u8 channel_mask)
+{
+	int i;
 
-	default:
-		break;
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if ((channel_mask & BIT(i)) &&
+		    READ_ONCE(drvdata->control_mode[i]) != PWM_ENABLE_MANUAL)
+			return -EBUSY;
 	}
 
-unlock:
-	spin_unlock_irq(&drvdata->wq.lock);
-	return res;
+	return 0;
 }
 
-static int send_output_report(struct drvdata *drvdata, const void *data,
-			      size_t data_size)
+static void group_work_fn(struct work_struct *work)
 {
+	struct drvdata *drvdata = container_of(work, struct drvdata, group_work);
+	struct fan_group_request *req = drvdata->group_req;
+	u8 duty_percent[FAN_CHANNELS];
 	int ret;
 
-	if (data_size > sizeof(drvdata->output_buffer))
-		return -EINVAL;
+	memset(duty_percent, req->duty_percent, sizeof(duty_percent));
 
-	memcpy(drvdata->output_buffer, data, data_size);
+	/* mutex is held by set_group_duty_percent() */
+	ret = send_fan_speed_report(drvdata, drvdata->group_mask, duty_percent);
+	if (ret)
+		cmpxchg(&req->error, 0, ret);
 
-	if (data_size < sizeof(drvdata->output_buffer))
-		memset(drvdata->output_buffer + data_size, 0,
-		       sizeof(drvdata->output_buffer) - data_size);
+	if (atomic_dec_and_test(&req->pending))
+		complete(&req->done);
+}
 
-	ret = hid_hw_output_report(drvdata->hid, drvdata->output_buffer,
-				   sizeof(drvdata->output_buffer));
-	return ret < 0 ? ret : 0;
+/* Must be called with nzxt_smart2_devices_lock held */
+static u8 group_channel_mask(struct drvdata *drvdata, const char *name)
+{
+	u8 channel_mask = 0;
+	int i;
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		if (!strcmp(drvdata->group[i], name))
+			channel_mask |= BIT(i);
+	}
+
+	return channel_mask;
 }
 
-static int set_pwm(struct drvdata *drvdata, int channel, long val)
+/*
+ * Sets the duty cycle of all channels in the group: one report per device,
+ * sent in parallel. All channels must be in manual mode, otherwise nothing is
+ * changed.
+ *
+ * The mutex of every device in the group is taken (in list order, under
+ * nzxt_smart2_devices_lock) before the modes are checked, and held until all
+ * reports are sent, so no channel can leave manual mode halfway through. The
+ * reports are sent from system_unbound_wq: on output_wq, group_work could be
+ * queued behind work waiting for the mutex.
+ */
+static int set_group_duty_percent(const char *name, u8 duty)
 {
+	struct fan_group_request req = { .duty_percent = duty };
+	struct drvdata *drvdata;
+	int devices = 0;
 	int ret;
-	u8 duty_percent = scale_pwm_value(val, 255, 100);
 
-	struct set_fan_speed_report report = {
-		.report_id = OUTPUT_REPORT_ID_SET_FAN_SPEED,
-		.magic = 1,
-		.channel_bit_mask = 1 << channel
-	};
+	init_completion(&req.done);
 
-	ret = mutex_lock_interruptible(&drvdata->mutex);
+	ret = mutex_lock_interruptible(&nzxt_smart2_devices_lock);
 	if (ret)
 		return ret;
 
-	report.duty_percent[channel] = duty_percent;
-	ret = send_output_report(drvdata, &report, sizeof(report));
+	list_for_each_entry(drvdata, &nzxt_smart2_devices, node) {
+		drvdata->group_mask = group_channel_mask(drvdata, name);
+		if (!drvdata->group_mask)
+			continue;
+
+		stat_inc(drvdata, STAT_MUTEX_LOCKED);
+		mutex_lock_nest_lock(&drvdata->mutex, &nzxt_smart2_devices_lock);
+
+		if (check_group_manual(drvdata, drvdata->group_mask))
+			ret = -EBUSY;
+
+		devices++;
+	}
+
+	if (!ret && !devices)
+		ret = -ENOENT;
+
 	if (ret)
 		goto unlock;
 
-	/*
-	 * pwmconfig and fancontrol scripts expect pwm writes to take effect
-	 * immediately (i. e. read from pwm* sysfs should return the value
-	 * written into it). The device seems to always accept pwm values - even
-	 * when there is no fan connected - so update pwm status without waiting
-	 * for a report, to make pwmconfig and fancontrol happy. Worst case -
-	 * if the device didn't accept new pwm value for some reason (never seen
-	 * this in practice) - it will be reported incorrectly only until next
-	 * update. This avoids "fan stuck" messages from pwmconfig, and
-	 * fancontrol setting fan speed to 100% during shutdown.
-	 */
-	spin_lock_bh(&drvdata->wq.lock);
-	drvdata->fan_duty_percent[channel] = duty_percent;
-	spin_unlock_bh(&drvdata->wq.lock);
+	atomic_set(&req.pending, devices);
+
+	list_for_each_entry(drvdata, &nzxt_smart2_devices, node) {
+		if (!drvdata->group_mask)
+			continue;
+
+		stat_inc(drvdata, STAT_PWM_WRITES);
+
+		/* The group write overrides ramps and coalesced writes */
+		drvdata->ramp_mask &= ~drvdata->group_mask;
+		drvdata->pwm_pending_mask &= ~drvdata->group_mask;
+		drvdata->pwm_pending_async_mask &= ~drvdata->group_mask;
+
+		drvdata->group_req = &req;
+		queue_work(system_unbound_wq, &drvdata->group_work);
+	}
+
+	wait_for_completion(&req.done);
+	ret = req.error;
+
+unlock:
+	list_for_each_entry(drvdata, &nzxt_smart2_devices, node) {
+		if (drvdata->group_mask)
+			mutex_unlock(&drvdata->mutex);
+	}
+
+	mutex_unlock(&nzxt_smart2_devices_lock);
+	return ret;
+}
+
+static ssize_t group_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	ssize_t ret;
+
+	ret = mutex_lock_interruptible(&nzxt_smart2_devices_lock);
+	if (ret)
+		return ret;
+
+	ret = sysfs_emit(buf, "%s\n", drvdata->group[channel]);
+
+	mutex_unlock(&nzxt_smart2_devices_lock);
+	return ret;
+}
+
+static ssize_t group_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	size_t len = strcspn(buf, "\n");
+	int ret;
+
+	if (len >= FAN_GROUP_NAME_LEN)
+		return -EINVAL;
+
+	ret = mutex_lock_interruptible(&nzxt_smart2_devices_lock);
+	if (ret)
+		return ret;
+
+	memcpy(drvdata->group[channel], buf, len);
+	drvdata->group[channel][len] = 0;
+
+	/* Whitespace separates the name from the value in group_pwm */
+	if (strpbrk(drvdata->group[channel], " \t")) {
+		drvdata->group[channel][0] = 0;
+		ret = -EINVAL;
+	}
+
+	mutex_unlock(&nzxt_smart2_devices_lock);
+	return ret ? ret : count;
+}
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_group, group, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_group, group, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_group, group, 2);
+
+#define CURVE_POINT_ATTRS(channel, point)					\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##channel##_auto_point##point##_temp,	\
+				       curve_temp, channel - 1, point - 1);	\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##channel##_auto_point##point##_pwm,	\
+				       curve_pwm, channel - 1, point - 1)
+
+#define CURVE_ATTRS(channel)							\
+	CURVE_POINT_ATTRS(channel, 1);						\
+	CURVE_POINT_ATTRS(channel, 2);						\
+	CURVE_POINT_ATTRS(channel, 3);						\
+	CURVE_POINT_ATTRS(channel, 4);						\
+	CURVE_POINT_ATTRS(channel, 5);						\
+	static SENSOR_DEVICE_ATTR_RW(pwm##channel##_auto_temp_hyst,		\
+				     curve_temp_hyst, channel - 1);		\
+	static SENSOR_DEVICE_ATTR_RW(pwm##channel##_auto_temp_source,		\
+				     curve_temp_source, channel - 1)
+
+#define CURVE_POINT_ATTR_REFS(channel, point)					\
+	&sensor_dev_attr_pwm##channel##_auto_point##point##_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##channel##_auto_point##point##_pwm.dev_attr.attr
+
+#define CURVE_ATTR_REFS(channel)						\
+	CURVE_POINT_ATTR_REFS(channel, 1),					\
+	CURVE_POINT_ATTR_REFS(channel, 2),					\
+	CURVE_POINT_ATTR_REFS(channel, 3),					\
+	CURVE_POINT_ATTR_REFS(channel, 4),					\
+	CURVE_POINT_ATTR_REFS(channel, 5),					\
+	&sensor_dev_attr_pwm##channel##_auto_temp_hyst.dev_attr.attr,		\
+	&sensor_dev_attr_pwm##channel##_auto_temp_source.dev_attr.attr
+
+CURVE_ATTRS(1);
+CURVE_ATTRS(2);
+CURVE_ATTRS(3);
+
+static struct attribute *nzxt_smart2_attrs[] = {
+	&dev_attr_sample_count.attr,
+	&dev_attr_sample_stale.attr,
+	&dev_attr_rescan.attr,
+	&dev_attr_update_interval_auto.attr,
+	&sensor_dev_attr_pwm1_ramp_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm2_ramp_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm3_ramp_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm1_group.dev_attr.attr,
+	&sensor_dev_attr_pwm2_group.dev_attr.attr,
+	&sensor_dev_attr_pwm3_group.dev_attr.attr,
+	CURVE_ATTR_REFS(1),
+	CURVE_ATTR_REFS(2),
+	CURVE_ATTR_REFS(3),
+	NULL
+};
+
+ATTRIBUTE_GROUPS(nzxt_smart2);
+
+static const struct hwmon_ops nzxt_smart2_hwmon_ops = {
+	.is_visible = nzxt_smart2_hwmon_is_visible,
+	.read = nzxt_smart2_hwmon_read,
+	.read_string = nzxt_smart2_hwmon_read_string,
+	.write = nzxt_smart2_hwmon_write,
+};
+
+static const struct hwmon_channel_info *nzxt_smart2_channel_info[] = {
+	HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_ALARM,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_ALARM,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_ALARM),
+	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT | HWMON_PWM_MODE | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_MODE | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_MODE | HWMON_PWM_ENABLE),
+	HWMON_CHANNEL_INFO(in, HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL),
+	HWMON_CHANNEL_INFO(curr, HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX |
+				 HWMON_C_ALARM,
+			   HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX |
+				 HWMON_C_ALARM,
+			   HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX |
+				 HWMON_C_ALARM),
+	HWMON_CHANNEL_INFO(power, HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL),
+	HWMON_CHANNEL_INFO(energy, HWMON_E_INPUT | HWMON_E_LABEL,
+			   HWMON_E_INPUT | HWMON_E_LABEL,
+			   HWMON_E_INPUT | HWMON_E_LABEL),
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+	NULL
+};
+
+static const struct hwmon_chip_info nzxt_smart2_chip_info = {
+	.ops = &nzxt_smart2_hwmon_ops,
+	.info = nzxt_smart2_channel_info,
+};
+
+static int nzxt_smart2_hid_raw_event(struct hid_device *hdev,
+				     struct hid_report *report, u8 *data, int size)
+{
+	struct drvdata *drvdata = hid_get_drvdata(hdev);
+	enum nzxt_smart2_raw_event_status status = NZXT_SMART2_RAW_EVENT_IGNORED;
+	u8 report_id = *data;
+
+	switch (report_id) {
+	case INPUT_REPORT_ID_FAN_CONFIG:
+		status = handle_fan_config_report(drvdata, data, size);
+		break;
+
+	case INPUT_REPORT_ID_FAN_STATUS:
+		status = handle_fan_status_report(drvdata, data, size);
+		break;
+	}
+
+	switch (status) {
+	case NZXT_SMART2_RAW_EVENT_ACCEPTED:
+		if (report_id == INPUT_REPORT_ID_FAN_CONFIG)
+			stat_inc(drvdata, STAT_CONFIG_REPORTS);
+		else if (data[1] == FAN_STATUS_REPORT_SPEED)
+			stat_inc(drvdata, STAT_SPEED_REPORTS);
+		else
+			stat_inc(drvdata, STAT_VOLTAGE_REPORTS);
+		break;
+
+	case NZXT_SMART2_RAW_EVENT_IGNORED:
+		stat_inc(drvdata, STAT_IGNORED_REPORTS);
+		break;
+
+	case NZXT_SMART2_RAW_EVENT_BAD_SIZE:
+		stat_inc(drvdata, STAT_DROPPED_BAD_SIZE);
+		break;
+
+	case NZXT_SMART2_RAW_EVENT_BAD_MAGIC:
+		stat_inc(drvdata, STAT_DROPPED_BAD_MAGIC);
+		break;
+
+	case NZXT_SMART2_RAW_EVENT_NOT_READY:
+		stat_inc(drvdata, STAT_DROPPED_NOT_READY);
+		break;
+	}
+
+	trace_nzxt_smart2_raw_event(hdev, data, size, status);
+
+	return 0;
+}
+
+static void get_sample_snapshot(struct drvdata *drvdata,
+				struct sample_snapshot *snapshot)
+{
+	struct sample_snapshot_channel *channel;
+	unsigned int seq;
+	int i;
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->version = SAMPLE_SNAPSHOT_VERSION;
+	snapshot->size = sizeof(*snapshot);
+	snapshot->update_interval = READ_ONCE(drvdata->update_interval);
+
+	do {
+		seq = read_seqcount_begin(&drvdata->sample_seq);
+
+		snapshot->flags = 0;
+		if (drvdata->fan_config_received)
+			snapshot->flags |= SAMPLE_SNAPSHOT_FAN_CONFIG;
+		if (drvdata->pwm_status_received)
+			snapshot->flags |= SAMPLE_SNAPSHOT_SPEED;
+		if (drvdata->voltage_status_received)
+			snapshot->flags |= SAMPLE_SNAPSHOT_VOLTAGE;
+		if (drvdata->sample_stale)
+			snapshot->flags |= SAMPLE_SNAPSHOT_STALE;
 
-unlock:
-	mutex_unlock(&drvdata->mutex);
-	return ret;
+		snapshot->sample_count = drvdata->sample_count;
+		snapshot->timestamp_ns = ktime_to_ns(drvdata->sample_time);
+
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			channel = &snapshot->channels[i];
+			channel->rpm = drvdata->fan_rpm[i];
+			channel->in = drvdata->fan_in[i];
+			channel->curr = drvdata->fan_curr[i];
+			channel->pwm = scale_pwm_value(drvdata->fan_duty_percent[i],
+						       100, 255);
+			channel->fan_type = drvdata->fan_type[i];
+		}
+	} while (read_seqcount_retry(&drvdata->sample_seq, seq));
 }
 
 /*
- * Workaround for fancontrol/pwmconfig trying to write to pwm*_enable even if it
- * already is 1 and read-only. Otherwise, fancontrol won't restore pwm on
- * shutdown properly.
+ * Each read() at offset 0 returns a fresh snapshot, so pread(fd, buf,
+ * sizeof(struct sample_snapshot), 0) gets the whole device state with a single
+ * syscall.
  */
-static int set_pwm_enable(struct drvdata *drvdata, int channel, long val)
+static ssize_t sample_read(struct file *file, char __user *buf, size_t count,
+			   loff_t *ppos)
 {
-	long expected_val;
-	int res;
+	struct drvdata *drvdata = file->private_data;
+	struct sample_snapshot snapshot;
 
-	spin_lock_irq(&drvdata->wq.lock);
+	get_sample_snapshot(drvdata, &snapshot);
+	mark_sample_consumed(drvdata);
 
-	res = wait_event_interruptible_locked_irq(drvdata->wq,
-						  drvdata->fan_config_received);
-	if (res) {
-		spin_unlock_irq(&drvdata->wq.lock);
-		return res;
-	}
-
-	expected_val = drvdata->fan_type[channel] != FAN_TYPE_NONE;
-
-	spin_unlock_irq(&drvdata->wq.lock);
-
-	return (val == expected_val) ? 0 : -EOPNOTSUPP;
+	return simple_read_from_buffer(buf, count, ppos, &snapshot,
+				       sizeof(snapshot));
 }
 
+static const struct file_operations sample_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = sample_read,
+	.llseek = default_llseek,
+};
+
 /*
- * Control byte	| Actual update interval in seconds
- * 0xff		| 65.5
- * 0xf7		| 63.46
- * 0x7f		| 32.74
- * 0x3f		| 16.36
- * 0x1f		| 8.17
- * 0x0f		| 4.07
- * 0x07		| 2.02
- * 0x03		| 1.00
- * 0x02		| 0.744
- * 0x01		| 0.488
- * 0x00		| 0.25
+ * The history file is created with debugfs_create_file_unsafe() (debugfs
+ * proxy file operations don't support mmap()), so protect against concurrent
+ * removal manually.
  */
-static u8 update_interval_to_control_byte(long interval)
+static int history_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	if (interval <= 250)
-		return 0;
+	struct dentry *dentry = file->f_path.dentry;
+	struct drvdata *drvdata = file->private_data;
+	int ret;
+
+	ret = debugfs_file_get(dentry);
+	if (ret)
+		return ret;
 
-	return clamp_val(1 + DIV_ROUND_CLOSEST(interval - 488, 256), 0, 255);
+	ret = remap_vmalloc_range(vma, drvdata->history, vma->vm_pgoff);
+
+	debugfs_file_put(dentry);
+	return ret;
 }
 
-static long control_byte_to_update_interval(u8 control_byte)
-{
-	if (control_byte == 0)
-		return 250;
+static const struct file_operations history_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.mmap = history_mmap,
+};
 
-	return 488 + (control_byte - 1) * 256;
+static void history_free(void *history)
+{
+	vfree(history);
 }
 
-static int set_update_interval(struct drvdata *drvdata, long val)
+static int history_init(struct drvdata *drvdata)
 {
-	u8 control = update_interval_to_control_byte(val);
-	u8 report[] = {
-		OUTPUT_REPORT_ID_INIT_COMMAND,
-		INIT_COMMAND_SET_UPDATE_INTERVAL,
-		0x01,
-		0xe8,
-		control,
-		0x01,
-		0xe8,
-		control,
-	};
+	unsigned int entries = min(history_size, HISTORY_SIZE_MAX);
+	struct history_header *header;
 	int ret;
 
-	ret = send_output_report(drvdata, report, sizeof(report));
+	BUILD_BUG_ON(sizeof(struct history_header) > PAGE_SIZE);
+
+	if (!entries)
+		return 0;
+
+	entries = roundup_pow_of_two(entries);
+
+	header = vmalloc_user(PAGE_SIZE + entries * sizeof(struct history_entry));
+	if (!header)
+		return -ENOMEM;
+
+	/*
+	 * Pages that are still mapped stay alive after vfree(), so it's fine
+	 * to free the buffer on device removal.
+	 */
+	ret = devm_add_action_or_reset(&drvdata->hid->dev, history_free, header);
 	if (ret)
 		return ret;
 
-	drvdata->update_interval = control_byte_to_update_interval(control);
+	header->version = HISTORY_VERSION;
+	header->entry_size = sizeof(struct history_entry);
+	header->entries = entries;
+	header->offset = PAGE_SIZE;
+	header->flags = READ_ONCE(history_overwrite) ? HISTORY_OVERWRITE : 0;
+
+	drvdata->history_entries = (void *)header + PAGE_SIZE;
+	drvdata->history_size = entries;
+	drvdata->history = header;
 	return 0;
 }
 
-static int init_device(struct drvdata *drvdata, long update_interval)
+static const char *const stat_names[STAT_COUNT] = {
+	[STAT_CONFIG_REPORTS] = "config_reports",
+	[STAT_SPEED_REPORTS] = "speed_reports",
+	[STAT_VOLTAGE_REPORTS] = "voltage_reports",
+	[STAT_IGNORED_REPORTS] = "ignored_reports",
+	[STAT_DROPPED_BAD_SIZE] = "dropped_bad_size",
+	[STAT_DROPPED_BAD_MAGIC] = "dropped_bad_magic",
+	[STAT_DROPPED_NOT_READY] = "dropped_not_ready",
+	[STAT_OUTPUT_REPORTS] = "output_reports",
+	[STAT_OUTPUT_ERRORS] = "output_errors",
+	[STAT_MUTEX_LOCKED] = "mutex_locked",
+	[STAT_MUTEX_CONTENDED] = "mutex_contended",
+	[STAT_PWM_WRITES] = "pwm_writes",
+	[STAT_PWM_WRITES_UNCHANGED] = "pwm_writes_unchanged",
+	[STAT_PWM_ASYNC_WRITES] = "pwm_async_writes",
+	[STAT_PWM_REPORTS] = "pwm_reports",
+};
+
+static const char *const stat_hist_names[STAT_HIST_COUNT] = {
+	[STAT_HIST_READ_WAIT] = "read_wait",
+	[STAT_HIST_OUTPUT] = "output_report",
+};
+
+/* Sums per-CPU statistics. Readers can see slightly stale values. */
+static void stats_sum(struct drvdata *drvdata, struct stats *sum)
 {
-	int ret;
-	u8 detect_fans_report[] = {
-		OUTPUT_REPORT_ID_INIT_COMMAND,
-		INIT_COMMAND_DETECT_FANS,
-	};
+	struct stats *cpu_stats;
+	int cpu, i, j;
 
-	ret = send_output_report(drvdata, detect_fans_report,
-				 sizeof(detect_fans_report));
-	if (ret)
-		return ret;
+	memset(sum, 0, sizeof(*sum));
 
-	return set_update_interval(drvdata, update_interval);
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(drvdata->stats, cpu);
+
+		for (i = 0; i < STAT_COUNT; i++)
+			sum->counters[i] += READ_ONCE(cpu_stats->counters[i]);
+
+		for (i = 0; i < STAT_HIST_COUNT; i++)
+			for (j = 0; j < STAT_HIST_BUCKETS; j++)
+				sum->hist[i][j] += READ_ONCE(cpu_stats->hist[i][j]);
+	}
 }
 
-static int nzxt_smart2_hwmon_write(struct device *dev,
-				   enum hwmon_sensor_types type, u32 attr,
-				   int channel, long val)
+static int stats_show(struct seq_file *s, void *unused)
 {
-	struct drvdata *drvdata = dev_get_drvdata(dev);
-	int ret;
+	struct drvdata *drvdata = s->private;
+	struct stats *sum;
+	int i, j;
 
-	switch (type) {
-	case hwmon_pwm:
-		switch (attr) {
-		case hwmon_pwm_enable:
-			return set_pwm_enable(drvdata, channel, val);
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
 
-		case hwmon_pwm_input:
-			return set_pwm(drvdata, channel, val);
+	stats_sum(drvdata, sum);
 
-		default:
-			return -EINVAL;
-		}
+	spin_lock(&drvdata->stats_lock);
 
-	case hwmon_chip:
-		switch (attr) {
-		case hwmon_chip_update_interval:
-			ret = mutex_lock_interruptible(&drvdata->mutex);
-			if (ret)
-				return ret;
+	for (i = 0; i < STAT_COUNT; i++)
+		sum->counters[i] -= drvdata->stats_base.counters[i];
 
-			ret = set_update_interval(drvdata, val);
+	for (i = 0; i < STAT_HIST_COUNT; i++)
+		for (j = 0; j < STAT_HIST_BUCKETS; j++)
+			sum->hist[i][j] -= drvdata->stats_base.hist[i][j];
 
-			mutex_unlock(&drvdata->mutex);
-			return ret;
+	spin_unlock(&drvdata->stats_lock);
 
-		default:
-			return -EINVAL;
-		}
+	for (i = 0; i < STAT_COUNT; i++)
+		seq_printf(s, "%s: %llu\n", stat_names[i], sum->counters[i]);
 
-	default:
-		return -EINVAL;
+	for (i = 0; i < STAT_HIST_COUNT; i++) {
+		seq_printf(s, "\n%s:\n", stat_hist_names[i]);
+
+		for (j = 0; j < STAT_HIST_BUCKETS - 1; j++)
+			seq_printf(s, "  < %u us: %llu\n", 1u << j,
+				   sum->hist[i][j]);
+
+		seq_printf(s, " >= %u us: %llu\n", 1u << (STAT_HIST_BUCKETS - 2),
+			   sum->hist[i][STAT_HIST_BUCKETS - 1]);
 	}
+
+	kfree(sum);
+	return 0;
 }
 
-static int nzxt_smart2_hwmon_read_string(struct device *dev,
-					 enum hwmon_sensor_types type, u32 attr,
-					 int channel, const char **str)
+static int stats_open(struct inode *inode, struct file *file)
 {
-	switch (type) {
-	case hwmon_fan:
-		*str = fan_label[channel];
-		return 0;
-	case hwmon_curr:
-		*str = curr_label[channel];
-		return 0;
-	case hwmon_in:
-		*str = in_label[channel];
-		return 0;
-	default:
-		return -EINVAL;
-	}
+	return single_open(file, stats_show, inode->i_private);
 }
 
-static const struct hwmon_ops nzxt_smart2_hwmon_ops = {
-	.is_visible = nzxt_smart2_hwmon_is_visible,
-	.read = nzxt_smart2_hwmon_read,
-	.read_string = nzxt_smart2_hwmon_read_string,
-	.write = nzxt_smart2_hwmon_write,
-};
+/* Writing anything resets the statistics */
+static ssize_t stats_write(struct file *file, const char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct drvdata *drvdata = s->private;
+	struct stats *sum;
 
-static const struct hwmon_channel_info *nzxt_smart2_channel_info[] = {
-	HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL),
-	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT | HWMON_PWM_MODE | HWMON_PWM_ENABLE,
-			   HWMON_PWM_INPUT | HWMON_PWM_MODE | HWMON_PWM_ENABLE,
-			   HWMON_PWM_INPUT | HWMON_PWM_MODE | HWMON_PWM_ENABLE),
-	HWMON_CHANNEL_INFO(in, HWMON_I_INPUT | HWMON_I_LABEL,
-			   HWMON_I_INPUT | HWMON_I_LABEL,
-			   HWMON_I_INPUT | HWMON_I_LABEL),
-	HWMON_CHANNEL_INFO(curr, HWMON_C_INPUT | HWMON_C_LABEL,
-			   HWMON_C_INPUT | HWMON_C_LABEL,
-			   HWMON_C_INPUT | HWMON_C_LABEL),
-	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
-	NULL
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	stats_sum(drvdata, sum);
+
+	spin_lock(&drvdata->stats_lock);
+	drvdata->stats_base = *sum;
+	spin_unlock(&drvdata->stats_lock);
+
+	kfree(sum);
+	return count;
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.write = stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
 
-static const struct hwmon_chip_info nzxt_smart2_chip_info = {
-	.ops = &nzxt_smart2_hwmon_ops,
-	.info = nzxt_smart2_channel_info,
+static const char *const report_timing_names[REPORT_TIMING_TYPES] = {
+	[REPORT_TIMING_SPEED] = "speed",
+	[REPORT_TIMING_VOLTAGE] = "voltage",
 };
 
-static int nzxt_smart2_hid_raw_event(struct hid_device *hdev,
-				     struct hid_report *report, u8 *data, int size)
+static int timing_show(struct seq_file *s, void *unused)
 {
-	struct drvdata *drvdata = hid_get_drvdata(hdev);
-	u8 report_id = *data;
+	struct drvdata *drvdata = s->private;
+	struct report_timing timing[REPORT_TIMING_TYPES];
+	u64 unpaired, out_of_order;
+	u8 control;
+	int i, j;
 
-	switch (report_id) {
-	case INPUT_REPORT_ID_FAN_CONFIG:
-		handle_fan_config_report(drvdata, data, size);
-		break;
+	spin_lock_bh(&drvdata->wq.lock);
+	memcpy(timing, drvdata->timing, sizeof(timing));
+	unpaired = drvdata->unpaired_reports;
+	out_of_order = drvdata->out_of_order_pairs;
+	control = drvdata->update_control;
+	spin_unlock_bh(&drvdata->wq.lock);
 
-	case INPUT_REPORT_ID_FAN_STATUS:
-		handle_fan_status_report(drvdata, data, size);
-		break;
+	seq_printf(s, "control byte: 0x%02x\n", control);
+	seq_printf(s, "nominal interval: %ld ms\n",
+		   control_byte_to_update_interval(control));
+	seq_printf(s, "unpaired reports: %llu\n", unpaired);
+	seq_printf(s, "out of order pairs: %llu\n", out_of_order);
+
+	for (i = 0; i < REPORT_TIMING_TYPES; i++) {
+		seq_printf(s, "\n%s reports: %llu\n", report_timing_names[i],
+			   timing[i].reports);
+		seq_printf(s, "%s missed: %llu\n", report_timing_names[i],
+			   timing[i].missed);
+		seq_printf(s, "%s last interval: %u us\n",
+			   report_timing_names[i], timing[i].interval_us);
+		seq_printf(s, "%s average interval: %u us\n",
+			   report_timing_names[i], timing[i].avg_interval_us8 / 8);
+
+		seq_printf(s, "%s jitter:\n", report_timing_names[i]);
+		for (j = 0; j < JITTER_BUCKETS - 1; j++)
+			seq_printf(s, "  < %u ms: %llu\n", 1u << j,
+				   timing[i].jitter[j]);
+		seq_printf(s, " >= %u ms: %llu\n", 1u << (JITTER_BUCKETS - 2),
+			   timing[i].jitter[JITTER_BUCKETS - 1]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(timing);
+
+/*
+ * Measured update interval for every control byte that was used, and the fit
+ * used for the other control bytes (see struct interval_map).
+ */
+static int calibration_show(struct seq_file *s, void *unused)
+{
+	struct drvdata *drvdata = s->private;
+	struct interval_calibration entry;
+	struct interval_map map;
+	int i;
+
+	seq_puts(s, "control\tnominal_us\tmeasured_us\tsamples\n");
+
+	for (i = 0; i < ARRAY_SIZE(drvdata->calibration); i++) {
+		spin_lock_bh(&drvdata->wq.lock);
+		entry = drvdata->calibration[i];
+		spin_unlock_bh(&drvdata->wq.lock);
+
+		if (!entry.count)
+			continue;
+
+		seq_printf(s, "0x%02x\t%ld\t%llu\t%u\n", i,
+			   control_byte_to_update_interval(i) * 1000,
+			   div_u64(entry.sum_us, entry.count), entry.count);
 	}
 
+	spin_lock_bh(&drvdata->wq.lock);
+	map = *interval_map_get(drvdata);
+	spin_unlock_bh(&drvdata->wq.lock);
+
+	if (map.fit)
+		seq_printf(s, "fit: interval_us = %lld + %lld * control\n",
+			   map.base_us, map.step_us);
+	else
+		seq_puts(s, "fit: none (nominal intervals are used)\n");
+
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(calibration);
+
+static void nzxt_smart2_debugfs_init(struct drvdata *drvdata)
+{
+	char name[64];
+
+	scnprintf(name, sizeof(name), "nzxt-smart2-%s",
+		  dev_name(&drvdata->hid->dev));
+
+	drvdata->debugfs = debugfs_create_dir(name, NULL);
+
+	debugfs_create_file("stats", 0644, drvdata->debugfs, drvdata,
+			    &stats_fops);
+	debugfs_create_file("sample", 0444, drvdata->debugfs, drvdata,
+			    &sample_fops);
+	debugfs_create_file("timing", 0444, drvdata->debugfs, drvdata,
+			    &timing_fops);
+	debugfs_create_file("calibration", 0444, drvdata->debugfs, drvdata,
+			    &calibration_fops);
+
+	if (drvdata->history)
+		debugfs_create_file_unsafe("history", 0600, drvdata->debugfs,
+					   drvdata, &history_fops);
+}
 
 static int __maybe_unused nzxt_smart2_hid_reset_resume(struct hid_device *hdev)
 {
 	struct drvdata *drvdata = hid_get_drvdata(hdev);
+	int ret;
 
 	/*
 	 * Userspace is still frozen (so no concurrent sysfs attribute access
 	 * is possible), but raw_event can already be called concurrently.
+	 *
+	 * The old values stay available to readers: they don't have to block
+	 * until the device sends new reports. Once fan detection completes,
+	 * restore_work sends the last pwm values again.
 	 */
-	spin_lock_bh(&drvdata->wq.lock);
-	drvdata->fan_config_received = false;
-	drvdata->pwm_status_received = false;
-	drvdata->voltage_status_received = false;
-	spin_unlock_bh(&drvdata->wq.lock);
+	wait_device_init(drvdata);
+
+	/* Background work (automatic fan control) may be sending reports */
+	lock_drvdata(drvdata);
+	ret = init_device(drvdata, READ_ONCE(drvdata->update_interval));
+	mutex_unlock(&drvdata->mutex);
 
-	return init_device(drvdata, drvdata->update_interval);
+	return ret;
 }
 
 static int nzxt_smart2_hid_probe(struct hid_device *hdev,
 				 const struct hid_device_id *id)
 {
 	struct drvdata *drvdata;
-	int ret;
+	int ret, i;
 
 	drvdata = devm_kzalloc(&hdev->dev, sizeof(struct drvdata), GFP_KERNEL);
 	if (!drvdata)
 		return -ENOMEM;
 
+	drvdata->probe_time = ktime_get();
 	drvdata->hid = hdev;
 	hid_set_drvdata(hdev, drvdata);
 
 	init_waitqueue_head(&drvdata->wq);
+	seqcount_spinlock_init(&drvdata->sample_seq, &drvdata->wq.lock);
+	INIT_WORK(&drvdata->notify_work, notify_work_fn);
+	INIT_WORK(&drvdata->control_work, control_work_fn);
+	INIT_WORK(&drvdata->cooling_work, cooling_work_fn);
+	INIT_WORK(&drvdata->interval_work, interval_work_fn);
+	INIT_WORK(&drvdata->restore_work, restore_work_fn);
+	INIT_WORK(&drvdata->init_work, init_work_fn);
+	INIT_WORK(&drvdata->detect_work, detect_work_fn);
+	drvdata->auto_detect_time = jiffies;
+	drvdata->update_interval = UPDATE_INTERVAL_DEFAULT_MS;
+	drvdata->adaptive.enabled = adaptive_update_interval;
+	drvdata->adaptive.target = -1;
+	drvdata->adaptive.window_start = jiffies;
+	drvdata->read_burst_time = jiffies - msecs_to_jiffies(ADAPTIVE_READ_BURST_MS);
+
+	for (i = 0; i < FAN_CHANNELS; i++) {
+		drvdata->control_mode[i] = PWM_ENABLE_MANUAL;
+		drvdata->curve[i] = default_fan_curve;
+		drvdata->cooling[i].drvdata = drvdata;
+		drvdata->cooling[i].channel = i;
+	}
 
 	mutex_init(&drvdata->mutex);
 	devm_add_action(&hdev->dev, (void (*)(void *))mutex_destroy,
 			&drvdata->mutex);
 
-	ret = hid_parse(hdev);
+	init_waitqueue_head(&drvdata->pwm_batch_wq);
+	INIT_DELAYED_WORK(&drvdata->pwm_work, pwm_work_fn);
+	drvdata->pwm_batch = 1;
+
+	INIT_DELAYED_WORK(&drvdata->ramp_work, ramp_work_fn);
+	INIT_WORK(&drvdata->group_work, group_work_fn);
+
+	INIT_WORK(&drvdata->output_work, output_work_fn);
+	spin_lock_init(&drvdata->output_queue_lock);
+
+	drvdata->stats = devm_alloc_percpu(&hdev->dev, struct stats);
+	if (!drvdata->stats)
+		return -ENOMEM;
+
+	spin_lock_init(&drvdata->stats_lock);
+
+	/* Before io starts: raw_event handlers write to the history buffer */
+	ret = history_init(drvdata);
 	if (ret)
 		return ret;
 
+	drvdata->output_wq = alloc_ordered_workqueue("nzxt-smart2-%s", 0,
+						     dev_name(&hdev->dev));
+	if (!drvdata->output_wq)
+		return -ENOMEM;
+
+	ret = hid_parse(hdev);
+	if (ret)
+		goto out_destroy_wq;
+
 	ret = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
 	if (ret)
-		return ret;
+		goto out_destroy_wq;
 
 	ret = hid_hw_open(hdev);
 	if (ret)
@@ -760,23 +4528,43 @@ static int nzxt_smart2_hid_probe(struct hid_device *hdev,
 
 	hid_device_io_start(hdev);
 
-	init_device(drvdata, UPDATE_INTERVAL_DEFAULT_MS);
+	/*
+	 * Don't wait for output reports here: on systems with several
+	 * devices, probes would be serialized on them.
+	 */
+	queue_work(drvdata->output_wq, &drvdata->init_work);
 
 	drvdata->hwmon =
 		hwmon_device_register_with_info(&hdev->dev, "nzxtsmart2", drvdata,
-						&nzxt_smart2_chip_info, NULL);
+						&nzxt_smart2_chip_info,
+						nzxt_smart2_groups);
 	if (IS_ERR(drvdata->hwmon)) {
 		ret = PTR_ERR(drvdata->hwmon);
 		goto out_hw_close;
 	}
 
+	set_work_enabled(drvdata, true);
+	nzxt_smart2_debugfs_init(drvdata);
+
+	mutex_lock(&nzxt_smart2_devices_lock);
+	list_add_tail(&drvdata->node, &nzxt_smart2_devices);
+	mutex_unlock(&nzxt_smart2_devices_lock);
+
+	if (boot_timing)
+		hid_info(hdev, "probe took %lld us\n",
+			 ktime_us_delta(ktime_get(), drvdata->probe_time));
+
 	return 0;
 
 out_hw_close:
+	cancel_work_sync(&drvdata->init_work);
 	hid_hw_close(hdev);
 
 out_hw_stop:
 	hid_hw_stop(hdev);
+
+out_destroy_wq:
+	destroy_workqueue(drvdata->output_wq);
 	return ret;
 }
 
@@ -784,12 +4572,87 @@ static void nzxt_smart2_hid_remove(struct hid_device *hdev)
 {
 	struct drvdata *drvdata = hid_get_drvdata(hdev);
 
+	/* Waits for the group write in progress, if any */
+	mutex_lock(&nzxt_smart2_devices_lock);
+	list_del(&drvdata->node);
+	mutex_unlock(&nzxt_smart2_devices_lock);
+
+	debugfs_remove_recursive(drvdata->debugfs);
+
+	set_work_enabled(drvdata, false);
+	unregister_cooling_devices(drvdata);
 	hwmon_device_unregister(drvdata->hwmon);
 
+	/* Ramps in progress stop where they are */
+	cancel_delayed_work_sync(&drvdata->ramp_work);
+
+	/*
+	 * Send writes that nobody waits for (fire-and-forget writes, and
+	 * coalesced writes that are still in the coalescing window).
+	 */
+	flush_delayed_work(&drvdata->pwm_work);
+	destroy_workqueue(drvdata->output_wq);
+
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
 }
 
+/* Lists all channels in groups: group name, hid device, pwm attribute */
+static ssize_t group_pwm_show(nzxt_smart2_driver_const struct device_driver *drv,
+			      char *buf)
+{
+	struct drvdata *drvdata;
+	ssize_t ret;
+	int len = 0;
+	int i;
+
+	ret = mutex_lock_interruptible(&nzxt_smart2_devices_lock);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(drvdata, &nzxt_smart2_devices, node) {
+		for (i = 0; i < FAN_CHANNELS; i++) {
+			if (!drvdata->group[i][0])
+				continue;
+
+			len += sysfs_emit_at(buf, len, "%s %s pwm%d\n",
+					     drvdata->group[i],
+					     dev_name(&drvdata->hid->dev), i + 1);
+		}
+	}
+
+	mutex_unlock(&nzxt_smart2_devices_lock);
+	return len;
+}
+
+/* Accepts "<group name> <pwm value>" */
+static ssize_t group_pwm_store(nzxt_smart2_driver_const struct device_driver *drv,
+			       const char *buf, size_t count)
+{
+	char name[FAN_GROUP_NAME_LEN];
+	long val;
+	int ret;
+
+	/* %15s: FAN_GROUP_NAME_LEN - 1 */
+	if (sscanf(buf, "%15s %ld", name, &val) != 2)
+		return -EINVAL;
+
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	ret = set_group_duty_percent(name, scale_pwm_value(val, 255, 100));
+	return ret ? ret : count;
+}
+
+static DRIVER_ATTR_RW(group_pwm);
+
+static struct attribute *nzxt_smart2_driver_attrs[] = {
+	&driver_attr_group_pwm.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(nzxt_smart2_driver);
+
 static const struct hid_device_id nzxt_smart2_hid_id_table[] = {
 	{ HID_USB_DEVICE(0x1e71, 0x2006) }, /* NZXT Smart Device V2 */
 	{ HID_USB_DEVICE(0x1e71, 0x200d) }, /* NZXT Smart Device V2 */
@@ -808,6 +4671,10 @@ static struct hid_driver nzxt_smart2_hid_driver = {
 #ifdef CONFIG_PM
 	.reset_resume = nzxt_smart2_hid_reset_resume,
 #endif
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+		.groups = nzxt_smart2_driver_groups,
+	},
 };
 
 static int __init nzxt_smart2_init(void)
@@ -833,3 +4700,7 @@ MODULE_LICENSE("GPL");
  */
 late_initcall(nzxt_smart2_init);
 module_exit(nzxt_smart2_exit);
+
+#ifdef NZXT_SMART2_KUNIT_TEST
+#include "nzxt-smart2-test.c"
+#endif